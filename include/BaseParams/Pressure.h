@@ -1,32 +1,68 @@
 #ifndef PRESSURE_h
 #define PRESSURE_h
 
-#include <Arduino.h>
+#include <stdint.h>
+
+/**
+ * Pressure is a fixed point number with PRESSURE_FRACTION_BITS fractional
+ * bits, so the whole pipeline from the ADC to the PID runs on integers.
+ * Floats are only used at the telemetry boundary.
+ */
+typedef int32_t pressure_t;
+
+const uint8_t PRESSURE_FRACTION_BITS = 8;
+const pressure_t PRESSURE_ONE = (pressure_t)1 << PRESSURE_FRACTION_BITS;
+
+/**
+ * ADS1115 at GAIN_SIXTEEN gives 7.8125 uV per LSB, the sensor gives 25 uV
+ * per pressure unit, so one LSB is 0.3125 = 80 / 256. The conversion is exact.
+ */
+inline pressure_t pressure_from_raw(const int16_t& raw) {
+    return (pressure_t)raw * 80;
+}
+
+inline pressure_t pressure_from_int(const int32_t& value) {
+    return value * PRESSURE_ONE;
+}
+
+inline pressure_t pressure_from_float(const float& value) {
+    return (pressure_t)(value * PRESSURE_ONE);
+}
+
+inline float pressure_to_float(const pressure_t& value) {
+    return (float)value / PRESSURE_ONE;
+}
+
+/* Raw ADS1115 conversion with the time it was completed at */
+struct PressureSample {
+    int16_t raw;
+    uint32_t timestamp_us;
+};
 
 class Pressure {
 public:
     Pressure();
 
-    void set_tare(const float& tare);
-    const float& get_tare();
+    void set_tare(const pressure_t& tare);
+    const pressure_t& get_tare();
 
-    void set_target(const float& target);
-    const float& get_target();
+    void set_target(const pressure_t& target);
+    const pressure_t& get_target();
 
-    void set_value(const float& value);
-    const float& get_value();
+    void set_value(const pressure_t& value);
+    const pressure_t& get_value();
 
-    const float& get_low_limit();
-    const float& get_optimal_high_limit();
-    const float& get_high_limit();
+    const pressure_t& get_low_limit();
+    const pressure_t& get_optimal_high_limit();
+    const pressure_t& get_high_limit();
 
 private:
-	float target_value;
-	float low_limit;
-	float optimal_high_limit;
-	float high_limit;
-	float tare_value;
-	float current_value;
+	pressure_t target_value;
+	pressure_t low_limit;
+	pressure_t optimal_high_limit;
+	pressure_t high_limit;
+	pressure_t tare_value;
+	pressure_t current_value;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,127 @@
+#ifndef burst_capture_h
+#define burst_capture_h
+
+#include <stdint.h>
+
+/**
+ * Single shot capture around a trigger, like an oscilloscope in the
+ * "single" mode.
+ *
+ * While armed, the producer writes every sample into the ring over the
+ * oldest one. A trigger only sets a flag; the producer takes it at its
+ * next sample, which becomes the first one after the trigger, fills the
+ * rest of the ring and freezes it. So the capture holds up to pre_trigger
+ * samples before the trigger and Size - pre_trigger from it on. A frozen
+ * capture is read by the consumer until the next arm().
+ *
+ * Size must be a power of two up to 32768, the indices are 16 bit.
+ */
+template <typename T, uint16_t Size>
+class BurstCapture {
+    static_assert(Size >= 2 && Size <= 32768 && (Size & (Size - 1)) == 0,
+                  "BurstCapture size must be a power of two up to 32768");
+
+public:
+    enum State : uint8_t {
+        IDLE,
+        ARMED,
+        TRIGGERED,
+        DONE
+    };
+
+    /* Drops the last capture and starts recording, pre_trigger is limited to Size - 1 */
+    void arm(const uint16_t& pre_trigger) {
+        /* The producer ignores the samples until the end */
+        state = IDLE;
+        __asm__ __volatile__("" ::: "memory");
+
+        head = 0;
+        count = 0;
+        is_trigger_pending = false;
+        post_trigger = Size - ((pre_trigger < Size) ? pre_trigger : Size - 1);
+        ++capture_id;
+
+        __asm__ __volatile__("" ::: "memory");
+        state = ARMED;
+    }
+
+    /* Any task, false if the capture isn't armed or is triggered already */
+    bool trigger(const uint8_t& reason) {
+        if (state != ARMED || is_trigger_pending)
+            return false;
+
+        trigger_reason = reason;
+
+        __asm__ __volatile__("" ::: "memory");
+        is_trigger_pending = true;
+
+        return true;
+    }
+
+    /* Producer side, true if this sample has completed the capture */
+    bool push(const T& sample) {
+        if (state != ARMED && state != TRIGGERED)
+            return false;
+
+        if (state == ARMED && is_trigger_pending) {
+            state = TRIGGERED;
+            remaining = post_trigger;
+        }
+
+        buffer[head] = sample;
+        head = (head + 1) & (Size - 1);
+
+        if (count < Size)
+            ++count;
+
+        if (state != TRIGGERED || --remaining != 0)
+            return false;
+
+        __asm__ __volatile__("" ::: "memory");
+        state = DONE;
+
+        return true;
+    }
+
+    State get_state() const {
+        return state;
+    }
+
+    /* Consumer side, valid in the DONE state */
+    uint16_t get_count() const {
+        return count;
+    }
+
+    /* Index of the first sample from the trigger on */
+    uint16_t get_trigger_index() const {
+        return count - post_trigger;
+    }
+
+    uint8_t get_reason() const {
+        return trigger_reason;
+    }
+
+    /* Changes with every arm(), tells one capture from another */
+    uint8_t get_id() const {
+        return capture_id;
+    }
+
+    /* index 0 is the oldest sample */
+    const T& get(const uint16_t& index) const {
+        return buffer[(head - count + index) & (Size - 1)];
+    }
+
+private:
+    T buffer[Size];
+    uint16_t head = 0;
+    uint16_t count = 0;
+    uint16_t post_trigger = Size;
+    uint16_t remaining = 0;
+    uint8_t capture_id = 0;
+
+    volatile State state = IDLE;
+    volatile bool is_trigger_pending = false;
+    volatile uint8_t trigger_reason = 0;
+};
+
+#endif
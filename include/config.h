@@ -19,8 +19,15 @@ namespace Pin {
 	const uint8_t temperature2_pin = 13;
     const uint8_t emulator_button_pin = 35;
     const uint8_t MOSFET_pin = 36;
+    const uint8_t ads_alert_pin = 2;            // ADS1115 ALERT/RDY, must be an external interrupt pin
 };
 
+/**
+ * 1 - read the ADS1115 on every ALERT/RDY falling edge (conversion ready)
+ * 0 - poll the last conversion result with a fixed delay
+ */
+#define PRESSURE_SENSOR_USE_ALERT_RDY 1
+
 enum Regime
 {
 	STOPED,
@@ -52,4 +59,30 @@ enum AlertType
 /** TODO: Нужно вспомнить, какую максимальную скорость мы можем поставить */
 const float PUMP_MAX_SPEED = 100;
 
+/**
+ * Скорость USB порта (8N1): CLI и телеметрия. Нагрузку на него от
+ * телеметрии показывает команда "telemetry bandwidth"
+ */
+const uint32_t SERIAL_BAUD_RATE = 115200;
+
+/**
+ * Скорость RS-485 до насоса (8E1), должна совпадать с настройкой насоса.
+ * Поддерживаются 9600, 19200, 38400, 57600 и 115200, паузы T1.5/T3.5
+ * Modbus считаются от неё
+ */
+const uint32_t PUMP_BAUD_RATE = 9600;
+
+/**
+ * Адреса насосов левой и правой почки на одной линии RS-485.
+ * Правый насос опрашивается, только если он установлен, иначе его
+ * таймауты занимали бы шину
+ */
+const uint8_t PUMP_LEFT_SLAVE_ID = 1;
+const uint8_t PUMP_RIGHT_SLAVE_ID = 2;
+const bool IS_RIGHT_PUMP_INSTALLED = false;
+
+/** Modbus RTU slave для SCADA на Serial2 (8E1) */
+const uint32_t SCADA_BAUD_RATE = 19200;
+const uint8_t SCADA_SLAVE_ID = 1;
+
 #endif
\ No newline at end of file
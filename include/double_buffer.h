@@ -0,0 +1,53 @@
+#ifndef double_buffer_h
+#define double_buffer_h
+
+#include <stdint.h>
+
+/**
+ * Single-writer double buffer for a snapshot bigger than one atomic store.
+ *
+ * The writer fills the back copy and publishes it by flipping the front
+ * index, so a reader never sees a half-written value and the writer never
+ * waits. The reader copies the front and retries if the writer has
+ * published in between: after one flip the writer starts filling the copy
+ * being read. Copies are short, so a retry is rare.
+ */
+template <typename T>
+class DoubleBuffer {
+public:
+    /* Writer side, fill it and then call publish() */
+    T& back() {
+        return buffers[front ^ 1];
+    }
+
+    void publish() {
+        /* The value must be in memory before a reader sees the new front */
+        __asm__ __volatile__("" ::: "memory");
+        front ^= 1;
+
+        /* 0 is kept for "nothing published yet" */
+        uint8_t count = publish_count + 1;
+        publish_count = (count != 0) ? count : 1;
+    }
+
+    /* Reader side, false if nothing has been published yet */
+    bool read(T& value) const {
+        uint8_t count;
+
+        do {
+            count = publish_count;
+            __asm__ __volatile__("" ::: "memory");
+            value = buffers[front];
+            __asm__ __volatile__("" ::: "memory");
+        } while (count != publish_count);
+
+        return count != 0;
+    }
+
+private:
+    T buffers[2];
+    volatile uint8_t front = 0;
+    volatile uint8_t publish_count = 0;
+};
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef exponential_smoother_h
+#define exponential_smoother_h
+
+#include <stdint.h>
+
+/**
+ * First order low pass on integers: state += (value - state) * k, where
+ * k = K / 65536 per sample.
+ *
+ * The state keeps ExtraBits more fractional bits than the input, otherwise
+ * a small k would round every step below 65536 / K input units to zero.
+ * With those bits the dead band is 65536 / K state units, i.e.
+ * 2^(16 - ExtraBits) / K input units.
+ */
+template <typename T, uint8_t ExtraBits = 8>
+class ExponentialSmoother {
+public:
+    explicit ExponentialSmoother(const uint16_t& k) : k(k) {}
+
+    void reset(const T& value) {
+        state = (int32_t)value << ExtraBits;
+    }
+
+    T push(const T& value) {
+        int32_t difference = ((int32_t)value << ExtraBits) - state;
+
+        /**
+         * difference * k >> 16 without a 64 bit product: the high half
+         * times k is already shifted, the low half times k fits in 32 bits.
+         * Both are 16x16 multiplies on AVR, the result is the same.
+         */
+        int16_t high = difference >> 16;
+        uint16_t low = difference;
+        state += (int32_t)high * k + (int32_t)(((uint32_t)low * k) >> 16);
+
+        return get_value();
+    }
+
+    T get_value() const {
+        return state >> ExtraBits;
+    }
+
+private:
+    uint16_t k;
+    int32_t state = 0;
+};
+
+#endif
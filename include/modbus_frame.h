@@ -0,0 +1,74 @@
+#ifndef modbus_frame_h
+#define modbus_frame_h
+
+#include <Arduino.h>
+#include "ModbusRtu.h"
+
+/**
+ * Complete Modbus RTU frames built by the compiler.
+ *
+ * A query that never changes (the same slave, register and value) is
+ * encoded and its CRC is calculated at compile time, the result is put
+ * into flash and sent with Modbus::queryFrame_P():
+ *
+ *   const ModbusFrame<MODBUS_WRITE_REGISTER_FRAME_SIZE> FRAME PROGMEM =
+ *       make_write_register_frame(1, 1000, 1);
+ */
+template <uint8_t Size>
+struct ModbusFrame
+{
+    uint8_t bytes[Size];
+
+    constexpr uint8_t size() const {
+        return Size;
+    }
+};
+
+/* FC6: id, function, address, value, CRC */
+const uint8_t MODBUS_WRITE_REGISTER_FRAME_SIZE = 8;
+
+/* The same CRC16 as crc16() in the library, low byte goes first on the wire */
+constexpr uint16_t modbus_crc16(const uint8_t *data, const uint8_t &size)
+{
+    uint16_t crc = 0xFFFF;
+
+    for (uint8_t i = 0; i < size; ++i) {
+        crc ^= data[i];
+
+        for (uint8_t bit = 0; bit < 8; ++bit)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+
+    return crc;
+}
+
+/* Appends the CRC to the first Size - 2 bytes of the frame */
+template <uint8_t Size>
+constexpr ModbusFrame<Size> seal_frame(ModbusFrame<Size> frame)
+{
+    uint16_t crc = modbus_crc16(frame.bytes, Size - 2);
+    frame.bytes[Size - 2] = crc & 0xFF;
+    frame.bytes[Size - 1] = crc >> 8;
+    return frame;
+}
+
+constexpr ModbusFrame<MODBUS_WRITE_REGISTER_FRAME_SIZE> make_write_register_frame(
+    const uint8_t &id, const uint16_t &address, const uint16_t &value)
+{
+    ModbusFrame<MODBUS_WRITE_REGISTER_FRAME_SIZE> frame = {{
+        id,
+        MB_FC_WRITE_REGISTER,
+        (uint8_t)(address >> 8), (uint8_t)(address & 0xFF),
+        (uint8_t)(value >> 8), (uint8_t)(value & 0xFF),
+        0, 0
+    }};
+
+    return seal_frame(frame);
+}
+
+/* Known answer: 01 06 03 E8 00 01 has CRC 0x7AC8 */
+static_assert(make_write_register_frame(1, 1000, 1).bytes[6] == 0xC8 &&
+              make_write_register_frame(1, 1000, 1).bytes[7] == 0x7A,
+              "constexpr Modbus CRC doesn't match crc16()");
+
+#endif
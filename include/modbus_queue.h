@@ -0,0 +1,170 @@
+#ifndef modbus_queue_h
+#define modbus_queue_h
+
+#include <Arduino.h>
+#include "ModbusRtu.h"
+
+/* Lower value is sent first */
+enum ModbusPriority
+{
+    MODBUS_PRIORITY_HIGH,
+    MODBUS_PRIORITY_NORMAL,
+    MODBUS_PRIORITY_LOW,
+    MODBUS_PRIORITY_IDLE    // background reads, only when nothing else is queued
+};
+
+/* Registers one transaction can carry: state, direction and speed of a pump */
+const uint8_t MODBUS_MAX_PAYLOAD = 4;
+
+/**
+ * What to do when a transaction fails (no reply, bad CRC, exception...).
+ * The attempt n+1 is sent not earlier than backoff_ms * 2^(n-1) after the
+ * attempt n has failed, other transactions may go in between.
+ */
+struct ModbusRetryPolicy
+{
+    uint8_t max_attempts;   // 0 and 1 - no retries
+    uint16_t timeout_ms;    // how long to wait for the reply, 0 - the master's setting
+    uint16_t backoff_ms;
+};
+
+struct ModbusTransaction;
+
+/**
+ * Called once per transaction after it has been completed, i.e. after the
+ * first successful attempt or after the last failed one.
+ * result is 0 if OK, otherwise Modbus::getLastError() (NO_REPLY, ERR_BAD_CRC...)
+ */
+typedef void (*ModbusCallback)(const ModbusTransaction &transaction, const uint8_t &result, void *context);
+
+struct ModbusTransaction
+{
+    /* telegram.au16reg is ignored, the queue points it to payload */
+    modbus_t telegram;
+
+    /**
+     * Prebuilt write frame in flash (see modbus_frame.h), sent as is
+     * instead of encoding telegram. NULL for the usual queries.
+     */
+    const uint8_t *frame;
+    uint8_t frame_size;
+
+    /**
+     * Registers to write, or the registers read by the reply.
+     * Every transaction owns its data, so a queued transaction can't be
+     * changed by a command pushed after it.
+     */
+    uint16_t payload[MODBUS_MAX_PAYLOAD];
+
+    ModbusPriority priority;
+
+    /**
+     * Transactions with the same tag write the same thing, e.g. the same
+     * register of the same slave. A new transaction replaces a queued one
+     * with the same tag if is_latest_wins is set.
+     */
+    uint8_t tag;
+    bool is_latest_wins;
+
+    ModbusRetryPolicy retry;
+
+    ModbusCallback callback;
+    void *context;
+};
+
+/**
+ * Bounded transaction queue of one slave.
+ *
+ * Modbus::query() refuses to send while the master waits for a reply,
+ * so instead of calling it directly all the commands are pushed here.
+ * The bus scheduler (see modbus_scheduler.h) takes them one by one as soon
+ * as the bus is free: the highest priority first, FIFO inside the same
+ * priority. The queue keeps the transaction until it is completed and
+ * sends it again if it fails.
+ *
+ * Any task may push, cancel and query, the bus task sends. All the
+ * methods are safe to call from different tasks, but not from an ISR.
+ */
+class ModbusQueue
+{
+public:
+    static const uint8_t CAPACITY = 8;
+
+public:
+    ModbusQueue();
+
+    /**
+     * Returns false if the queue is full or the telegram doesn't fit
+     * into the payload, the transaction is dropped then
+     */
+    bool push(const ModbusTransaction &transaction);
+
+    /* Removes a queued (not yet sent) transaction with the tag */
+    bool cancel(const uint8_t &tag);
+
+    /* Is there a queued (not yet sent) transaction with the tag */
+    bool contains(const uint8_t &tag);
+
+    /* Is a transaction with the tag sent and waiting for the reply */
+    bool is_sending(const uint8_t &tag);
+
+    /* Removes all the queued transactions, the one being sent is completed as usual */
+    void clear();
+
+    /**
+     * For the bus scheduler: is a transaction ready to be sent (not waiting
+     * for a backoff) and what is its priority
+     */
+    bool peek(ModbusPriority &priority);
+
+    /**
+     * For the bus scheduler: takes the next transaction to send it.
+     * It stays in the queue as the one being sent until end_send(),
+     * telegram.au16reg points to its payload until then.
+     */
+    const ModbusTransaction *begin_send();
+
+    /* result is 0 if OK, otherwise the error - the transaction is retried or completed */
+    void end_send(const uint8_t &result);
+
+    uint8_t size();
+    bool is_idle();
+
+    uint16_t get_dropped_count();
+    uint16_t get_coalesced_count();
+    uint16_t get_retry_count();
+    uint16_t get_failed_count();
+
+private:
+    struct Slot
+    {
+        ModbusTransaction transaction;
+        uint16_t sequence;
+        uint8_t attempt;        // attempts already made
+        uint32_t not_before_ms; // backoff, the slot isn't sent earlier
+        bool is_used;
+    };
+
+private:
+    /* Called inside a critical section */
+    bool push_slot(const ModbusTransaction &transaction);
+    int8_t find_tag(const uint8_t &tag);
+    int8_t find_next();
+    uint8_t count_used();
+    bool schedule_retry();
+
+private:
+    Slot slots[CAPACITY];
+    uint16_t next_sequence = 0;
+
+    /* The slot is freed when it is sent, a retry goes back to a free one */
+    Slot in_flight;
+    bool is_in_flight = false;
+
+    uint16_t dropped_count = 0;
+    uint16_t coalesced_count = 0;
+    uint16_t retry_count = 0;
+    uint16_t failed_count = 0;
+};
+
+#endif
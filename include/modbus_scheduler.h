@@ -0,0 +1,109 @@
+#ifndef modbus_scheduler_h
+#define modbus_scheduler_h
+
+#include <Arduino.h>
+#include "ModbusRtu.h"
+#include "modbus_queue.h"
+
+/**
+ * How much of the bus one slave may take: a token bucket refilled with
+ * max_per_second tokens a second, up to burst. Every transaction takes
+ * a token, except the MODBUS_PRIORITY_HIGH ones - a stop never waits.
+ * max_per_second = 0 - no limit, burst is at least 1.
+ */
+struct ModbusRateBudget
+{
+    uint8_t max_per_second;
+    uint8_t burst;
+};
+
+const ModbusRateBudget MODBUS_UNLIMITED_BUDGET = {0, 0};
+
+/**
+ * Modbus RTU allows 100..200 ms for the slaves to process a broadcast,
+ * nothing is sent to the bus during this time
+ */
+const uint16_t MODBUS_BROADCAST_TURNAROUND_MS = 100;
+
+/**
+ * Shares one Modbus master between the queues of several slaves.
+ *
+ * Every slave has its own ModbusQueue, so its tags and its coalescing
+ * don't interfere with the other slaves. When the bus is free the
+ * scheduler sends the transaction with the highest priority among the
+ * queue heads; between the slaves with the same priority it goes round
+ * robin, starting after the slave served last. A slave that has used up
+ * its rate budget is skipped until its bucket refills.
+ *
+ * A broadcast write (slave 0) goes before everything queued, right after
+ * the transaction being sent now.
+ */
+class ModbusScheduler
+{
+public:
+    static const uint8_t MAX_SLAVES = 4;
+
+public:
+    ModbusScheduler(Modbus &master);
+
+    /* Returns false if there are MAX_SLAVES already */
+    bool add_slave(ModbusQueue &queue, const ModbusRateBudget &budget = MODBUS_UNLIMITED_BUDGET);
+
+    /**
+     * Sends the prebuilt write frame (PROGMEM, see modbus_frame.h) addressed
+     * to slave 0. Can be called from an ISR, the frame is sent by process().
+     */
+    void broadcast(const uint8_t *frame, const uint8_t &size);
+
+    /* Checks the reply of the current transaction and sends the next one */
+    void process();
+
+    bool is_idle();
+
+    Modbus &get_master();
+
+    /* Scheduling rounds in which a slave was skipped because it had no tokens */
+    uint16_t get_throttled_count();
+    uint16_t get_broadcast_count();
+
+    /**
+     * Safe to call from another task: the master updates its stats in
+     * process(), so process() clears them before the next poll
+     */
+    void reset_stats();
+
+private:
+    struct Lane
+    {
+        ModbusQueue *queue;
+        ModbusRateBudget budget;
+        uint8_t tokens;
+        uint32_t last_refill_ms;
+    };
+
+private:
+    void refill(Lane &lane, const uint32_t &now);
+    int8_t find_next();
+
+private:
+    Modbus &master;
+
+    Lane lanes[MAX_SLAVES];
+    uint8_t lane_count = 0;
+
+    /* The lane served last, the search starts after it */
+    uint8_t last_lane = 0;
+    int8_t in_flight_lane = -1;
+
+    const uint8_t *volatile broadcast_frame = NULL;
+    volatile uint8_t broadcast_size = 0;
+    uint32_t broadcast_sent_ms = 0;
+    bool is_turnaround = false;
+
+    uint16_t throttled_count = 0;
+    uint16_t broadcast_count = 0;
+
+    volatile bool is_reset_requested = false;
+};
+
+#endif
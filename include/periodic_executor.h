@@ -0,0 +1,71 @@
+#ifndef periodic_executor_h
+#define periodic_executor_h
+
+#include <Arduino.h>
+#include <Arduino_FreeRTOS.h>
+
+/**
+ * Runs a task loop at a fixed rate using absolute wake times
+ * (vTaskDelayUntil), so the period doesn't drift by the loop body time.
+ *
+ * Usage:
+ *   for (;;) {
+ *       executor.wait_next_cycle();
+ *       ... control code ...
+ *   }
+ *
+ * Measures the real period and the execution time of every cycle.
+ * If a cycle took longer than the period, it is counted as an overrun and
+ * the schedule is moved forward instead of running missed cycles back to back.
+ */
+class PeriodicExecutor {
+public:
+    struct Stats {
+        uint32_t cycle_count;
+        uint32_t overrun_count;
+        uint32_t period_us;
+        uint32_t min_exec_us;
+        uint32_t max_exec_us;
+        uint32_t mean_exec_us;
+        /* Deviation of the measured period from period_us */
+        int32_t min_jitter_us;
+        int32_t max_jitter_us;
+        int32_t mean_jitter_us;
+    };
+
+public:
+    PeriodicExecutor(const TickType_t& period_ticks);
+
+    /* Ends the current cycle and blocks until the next one starts */
+    void wait_next_cycle();
+
+    TickType_t get_period_ticks() const;
+    uint32_t get_period_ms() const;
+
+    /* Safe to call from another task */
+    Stats get_stats();
+    void reset_stats();
+
+private:
+    TickType_t period_ticks;
+    TickType_t last_wake_ticks = 0;
+    bool is_started = false;
+    bool is_reset_requested = false;
+
+    uint32_t cycle_start_us = 0;
+
+    /* Number of measured periods, the first cycle has no period */
+    uint32_t cycle_count = 0;
+    uint32_t period_count = 0;
+    uint32_t overrun_count = 0;
+
+    uint32_t min_exec_us = 0;
+    uint32_t max_exec_us = 0;
+    uint64_t total_exec_us = 0;
+
+    int32_t min_jitter_us = 0;
+    int32_t max_jitter_us = 0;
+    int64_t total_jitter_us = 0;
+};
+
+#endif
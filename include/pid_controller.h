@@ -0,0 +1,167 @@
+#ifndef pid_controller_h
+#define pid_controller_h
+
+#include <stdint.h>
+
+/**
+ * Fixed point PID controller for a fixed sample period.
+ *
+ * Value        - type of the setpoint, the measurement and the output
+ * Accumulator  - type for the products of a gain and an error and for the
+ *                integral, must hold (max output) << GainFractionBits
+ * GainFractionBits - gains are stored with this many fractional bits
+ * DerivativeFilterShift - the derivative goes through a first order low pass
+ *                filter with the coefficient 1 / 2^DerivativeFilterShift
+ *
+ * - P works on the error (setpoint - measurement)
+ * - I is accumulated with GainFractionBits extra fractional bits, so small
+ *   errors are not lost. It is integrated only while the output is not
+ *   saturated, or while the error drives it back from the limit
+ *   (conditional integration anti-windup)
+ * - D works on the measurement, not on the error, so setpoint changes do
+ *   not kick the output
+ *
+ * The gains are given for a continuous controller and the sample period,
+ * they are converted to per-sample integer gains once in set_tunings() and
+ * rounded to the nearest step of 1 / 2^GainFractionBits. The relative error
+ * of a gain is up to 0.5 / (gain * 2^GainFractionBits): with 12 bits and a
+ * 30 ms period ki = 0.2 becomes 25 / 4096 per sample instead of 24.576 / 4096,
+ * 1.7 % more. kp and kd are far larger and are off by less than 0.1 %.
+ *
+ * A gain times an error saturates at a quarter of the Accumulator range
+ * instead of wrapping around, so a sensor jump can't flip the sign of the
+ * output (kd is about 27000 at 12 bits and 30 ms, kd * derivative would
+ * overflow int32 above 78000, 300 units at 8 fractional bits). The integral
+ * is limited to the output range, that must fit in a quarter too, then
+ * neither the integral nor the output sum can overflow.
+ */
+template <typename Value, typename Accumulator, uint8_t GainFractionBits, uint8_t DerivativeFilterShift = 2>
+class PidController {
+public:
+    PidController(const float& kp = 0, const float& ki = 0, const float& kd = 0,
+                  const uint16_t& period_ms = 100) {
+        set_tunings(kp, ki, kd, period_ms);
+    }
+
+    void set_tunings(const float& kp, const float& ki, const float& kd, const uint16_t& period_ms) {
+        const float ONE = (Accumulator)1 << GainFractionBits;
+        const float period_s = period_ms / 1000.0;
+
+        this->kp = round_gain(kp * ONE);
+        this->ki = round_gain(ki * period_s * ONE);
+        this->kd = round_gain(kd / period_s * ONE);
+
+        kp_limit = product_limit(this->kp);
+        ki_limit = product_limit(this->ki);
+        kd_limit = product_limit(this->kd);
+    }
+
+    void set_limits(const Value& min_output, const Value& max_output) {
+        this->min_output = min_output;
+        this->max_output = max_output;
+        integral = constrain_integral(integral);
+    }
+
+    /**
+     * Bumpless transfer: the next compute() with the same measurement and
+     * setpoint returns the current output instead of jumping from zero
+     */
+    void reset(const Value& setpoint, const Value& measurement, const Value& current_output) {
+        previous_measurement = measurement;
+        filtered_derivative = 0;
+
+        Value proportional = multiply(kp, kp_limit, setpoint - measurement) >> GainFractionBits;
+        integral = (Accumulator)constrain_output(current_output - proportional) << GainFractionBits;
+        output = constrain_output(current_output);
+    }
+
+    /* Must be called every period_ms given to set_tunings() */
+    Value compute(const Value& setpoint, const Value& measurement) {
+        Value error = setpoint - measurement;
+
+        /* Derivative on measurement through a low pass filter */
+        Value derivative = previous_measurement - measurement;
+        previous_measurement = measurement;
+        filtered_derivative += (derivative - filtered_derivative) >> DerivativeFilterShift;
+
+        Value proportional = multiply(kp, kp_limit, error) >> GainFractionBits;
+        Value differential = multiply(kd, kd_limit, filtered_derivative) >> GainFractionBits;
+        Accumulator new_integral = integral + multiply(ki, ki_limit, error);
+
+        Value unlimited_output = proportional + (Value)(new_integral >> GainFractionBits) + differential;
+
+        /* Integrate only if it doesn't push the output further into the limit */
+        bool is_saturated_high = unlimited_output > max_output && error > 0;
+        bool is_saturated_low = unlimited_output < min_output && error < 0;
+
+        if (!is_saturated_high && !is_saturated_low) {
+            integral = constrain_integral(new_integral);
+        }
+
+        output = constrain_output(proportional + (Value)(integral >> GainFractionBits) + differential);
+
+        return output;
+    }
+
+    const Value& get_output() const {
+        return output;
+    }
+
+private:
+    static constexpr Accumulator PRODUCT_MAX = (Accumulator)((((uint64_t)1 << (sizeof(Accumulator) * 8 - 1)) - 1) / 4);
+
+    static Accumulator round_gain(const float& gain) {
+        return (Accumulator)(gain < 0 ? gain - 0.5f : gain + 0.5f);
+    }
+
+    /* The largest |value| that gain * value can take without saturating */
+    static Accumulator product_limit(const Accumulator& gain) {
+        if (gain == 0)
+            return PRODUCT_MAX;
+        return PRODUCT_MAX / (gain < 0 ? -gain : gain);
+    }
+
+    static Accumulator multiply(const Accumulator& gain, const Accumulator& limit, const Value& value) {
+        if ((Accumulator)value > limit || (Accumulator)value < -limit) {
+            if (gain == 0)
+                return 0;
+            return ((gain < 0) == (value < 0)) ? PRODUCT_MAX : -PRODUCT_MAX;
+        }
+        return gain * value;
+    }
+
+    Value constrain_output(const Value& value) const {
+        if (value > max_output)
+            return max_output;
+        if (value < min_output)
+            return min_output;
+        return value;
+    }
+
+    Accumulator constrain_integral(const Accumulator& value) const {
+        if (value > ((Accumulator)max_output << GainFractionBits))
+            return (Accumulator)max_output << GainFractionBits;
+        if (value < ((Accumulator)min_output << GainFractionBits))
+            return (Accumulator)min_output << GainFractionBits;
+        return value;
+    }
+
+private:
+    Accumulator kp = 0;
+    Accumulator ki = 0;
+    Accumulator kd = 0;
+
+    Accumulator kp_limit = 0;
+    Accumulator ki_limit = 0;
+    Accumulator kd_limit = 0;
+
+    Value min_output = 0;
+    Value max_output = 0;
+
+    Accumulator integral = 0;
+    Value previous_measurement = 0;
+    Value filtered_derivative = 0;
+    Value output = 0;
+};
+
+#endif
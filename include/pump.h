@@ -3,64 +3,65 @@
 
 #include <Arduino.h>
 #include "ModbusRtu.h"
+#include "modbus_queue.h"
+#include "modbus_scheduler.h"
+#include "pump_driver.h"
+#include "config.h"
 
-enum PumpStates
-{
-    ON,
-    OFF
-};
+/**
+ * Period of the timer that watches the Modbus line for the end of a frame.
+ * It has to be shorter than T1.5, which is 750 us at the fastest rates.
+ */
+const uint16_t PUMP_RX_TIMER_TICK_US = 250;
 
-enum RotateDirections
+/**
+ * The pump of the stand: state, direction and speed in the registers
+ * 1000..1003, the speed is a float with the high word first
+ */
+struct StandPumpTraits
 {
-    COUNTERCLOCKWISE,
-    CLOCKWISE
-};
+    static constexpr uint16_t STATE_REGISTER = 1000;
+    static constexpr uint16_t DIRECTION_REGISTER = 1001;
+    static constexpr uint16_t SPEED_REGISTER = 1002;
 
-class Pump
-{
-public:
-    Pump();
-    ~Pump();
+    static constexpr uint16_t STATE_ON = 1;
+    static constexpr uint16_t STATE_OFF = 0;
+    static constexpr uint16_t DIRECTION_CLOCKWISE = 1;
+    static constexpr uint16_t DIRECTION_COUNTERCLOCKWISE = 0;
 
-    void start();
-    void stop();
-    void set_speed(const float &rmp);
-    float get_speed();
-    void set_rotate_direction(const RotateDirections &direction);
-    PumpStates get_state();
-    bool check_timeout();
+    typedef FloatSpeedEncoding<FLOAT_HIGH_WORD_FIRST> SpeedEncoding;
 
-    void process();
+    static constexpr bool HAS_WRITE_MULTIPLE_REGISTERS = true;
+    static constexpr bool HAS_READ_REGISTERS = true;
+};
 
-public:
-    bool is_new_modbus_message_ready = false;
-    uint8_t reply[20];
+typedef PumpDriver<StandPumpTraits> Pump;
 
-private:
-    void check_reply();
+/**
+ * A pump may take up to 20 transactions a second, 5 in a row, so two
+ * pumps on 9600 baud can't take the bus away from each other. Stops
+ * are not counted.
+ */
+const ModbusRateBudget PUMP_RATE_BUDGET = {20, 5};
 
-private:
-    PumpStates pump_state = PumpStates::OFF;
-    float pump_rmp = 0;
-    RotateDirections pump_rotate_direction = CLOCKWISE;
+/**
+ * The pump RS-485 line. All the pump commands go through the queue of
+ * the pump, never to the master directly.
+ */
+extern Modbus pump_master;
+extern ModbusScheduler pump_bus;
 
-    // data array for modbus network sharing
-    uint16_t au16data[10];
-    uint8_t u8state;
+extern ModbusQueue left_pump_queue;
+extern ModbusQueue right_pump_queue;
 
-    /** TODO: Add a separate modbus telegrams for start/stop, rotate
-     * direction and a motor speed */
-    /**
-     * This is an structe which contains a query to an slave device
-     */
-    // modbus_t telegram;
-    modbus_t state_tg;
-    modbus_t rotate_direction_tg;
-    modbus_t speed_tg;
+/* The pumps of the left and the right kidney, see config.h */
+extern Pump left_pump;
+extern Pump right_pump;
 
-    bool is_stop_command_sent = false;
-    bool is_start_command_sent = false;
-    bool is_set_speed_command_sent = false;
-};
+/* Serial port, frame timing and the pump queues, before the first pump_bus.process() */
+void begin_pump_bus();
+
+/* Stops all the pumps with one broadcast frame, call from the pump task */
+void emergency_stop_pumps();
 
-#endif
\ No newline at end of file
+#endif
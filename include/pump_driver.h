@@ -0,0 +1,844 @@
+#ifndef pump_driver_h
+#define pump_driver_h
+
+#include <Arduino.h>
+#include <Arduino_FreeRTOS.h>
+#include "ModbusRtu.h"
+#include "modbus_queue.h"
+#include "modbus_frame.h"
+
+enum PumpStates
+{
+    ON,
+    OFF
+};
+
+enum RotateDirections
+{
+    COUNTERCLOCKWISE,
+    CLOCKWISE
+};
+
+/**
+ * Every pump command is tried up to 3 times, waiting 300 ms for each reply,
+ * with 100 ms and then 200 ms pauses between the attempts
+ */
+const ModbusRetryPolicy PUMP_RETRY_POLICY = {3, 300, 100};
+
+/**
+ * How often the pump registers are read back. A read is sent only when
+ * the bus is idle, so it never delays a command.
+ */
+const uint16_t PUMP_STATUS_PERIOD_MS = 200;
+
+/**
+ * The pump polls its status this rarely while it doesn't reply,
+ * so a pump missing from the bus doesn't take the time of the others
+ */
+const uint16_t PUMP_OFFLINE_STATUS_PERIOD_MS = 2000;
+
+/**
+ * A status read isn't retried, so the pump goes offline only after this
+ * many of them have failed in a row. A command goes offline at once.
+ */
+const uint8_t PUMP_OFFLINE_STATUS_FAILURES = 3;
+
+/* Slave address of a pump as a type, see PumpDriver::PumpDriver() */
+template <uint8_t SlaveId>
+struct ModbusSlaveId
+{
+};
+
+/**
+ * Speed encodings, Traits::SpeedEncoding is one of them.
+ * REGISTER_COUNT registers starting at Traits::SPEED_REGISTER hold the speed.
+ */
+enum FloatWordOrder
+{
+    FLOAT_HIGH_WORD_FIRST,  // IEEE 754 float, the word with the sign and the exponent goes first
+    FLOAT_LOW_WORD_FIRST
+};
+
+template <FloatWordOrder WordOrder>
+struct FloatSpeedEncoding
+{
+    static constexpr uint8_t REGISTER_COUNT = 2;
+
+    static void encode(const float &rmp, uint16_t *registers)
+    {
+        uint32_t bits;
+        memcpy(&bits, &rmp, sizeof(bits));
+
+        registers[WordOrder == FLOAT_HIGH_WORD_FIRST ? 0 : 1] = bits >> 16;
+        registers[WordOrder == FLOAT_HIGH_WORD_FIRST ? 1 : 0] = bits & 0xFFFF;
+    }
+
+    static float decode(const uint16_t *registers)
+    {
+        uint32_t bits = ((uint32_t)registers[WordOrder == FLOAT_HIGH_WORD_FIRST ? 0 : 1] << 16) |
+                        registers[WordOrder == FLOAT_HIGH_WORD_FIRST ? 1 : 0];
+
+        float rmp;
+        memcpy(&rmp, &bits, sizeof(rmp));
+        return rmp;
+    }
+};
+
+/* Unsigned integer in one register, rpm * Scale */
+template <uint16_t Scale>
+struct ScaledSpeedEncoding
+{
+    static constexpr uint8_t REGISTER_COUNT = 1;
+
+    static void encode(const float &rmp, uint16_t *registers)
+    {
+        float scaled = rmp * Scale + 0.5;
+
+        if (scaled < 0)
+            scaled = 0;
+        if (scaled > 0xFFFF)
+            scaled = 0xFFFF;
+
+        registers[0] = (uint16_t)scaled;
+    }
+
+    static float decode(const uint16_t *registers)
+    {
+        return (float)registers[0] / Scale;
+    }
+};
+
+/**
+ * Modbus driver of a peristaltic pump.
+ *
+ * Traits describes the pump model, everything in it is a compile time
+ * constant, so there are no virtual calls and no branches on the model:
+ *
+ *   struct SomePumpTraits
+ *   {
+ *       // Register map
+ *       static constexpr uint16_t STATE_REGISTER = 1000;
+ *       static constexpr uint16_t DIRECTION_REGISTER = 1001;
+ *       static constexpr uint16_t SPEED_REGISTER = 1002;
+ *
+ *       // Register values
+ *       static constexpr uint16_t STATE_ON = 1;
+ *       static constexpr uint16_t STATE_OFF = 0;
+ *       static constexpr uint16_t DIRECTION_CLOCKWISE = 1;
+ *       static constexpr uint16_t DIRECTION_COUNTERCLOCKWISE = 0;
+ *
+ *       typedef FloatSpeedEncoding<FLOAT_HIGH_WORD_FIRST> SpeedEncoding;
+ *
+ *       // Supported function codes besides FC6
+ *       static constexpr bool HAS_WRITE_MULTIPLE_REGISTERS = true;   // FC16
+ *       static constexpr bool HAS_READ_REGISTERS = true;             // FC3
+ *   };
+ *
+ * The state and direction commands are complete frames built at compile
+ * time (see modbus_frame.h) for the slave address of every pump, only the
+ * speed is encoded at runtime. All the pumps of one model are one type:
+ *
+ *   PumpDriver<SomePumpTraits> left_pump(left_queue, ModbusSlaveId<1>());
+ *   PumpDriver<SomePumpTraits> right_pump(right_queue, ModbusSlaveId<2>());
+ *
+ * If state, direction and speed are consecutive registers, they are
+ * written in one FC16 frame and read back with one FC3 query.
+ */
+template <typename Traits>
+class PumpDriver
+{
+public:
+    /* queue is the pump's own, see ModbusScheduler */
+    template <uint8_t SlaveId>
+    PumpDriver(ModbusQueue &queue, ModbusSlaveId<SlaveId>);
+
+    uint8_t get_slave_id();
+
+    bool start();
+    bool stop();
+    bool set_speed(const float &rmp);
+    float get_speed();
+    void set_rotate_direction(const RotateDirections &direction);
+    PumpStates get_state();
+
+    /**
+     * Writes state, direction and speed at once. If more than one of them
+     * differs from what the pump has, all the registers go in a single
+     * FC16 frame instead of a frame per register.
+     */
+    bool apply_setpoint(const PumpStates &state, const RotateDirections &direction, const float &rmp);
+
+    /**
+     * What the pump reports about itself, read back every PUMP_STATUS_PERIOD_MS.
+     * The actual speed is 0 while the pump is stopped, it is the commanded
+     * one until the first successful read (or always if the pump can't be read).
+     */
+    float get_actual_speed();
+    PumpStates get_actual_state();
+    bool is_status_valid();
+
+    /**
+     * get_state() is the commanded state, it changes as soon as the command
+     * is queued. True if the pump hasn't confirmed it (by the write reply or
+     * the status read) and nothing is going to: no request, no write queued
+     * or in flight. So the write has failed all its attempts or the pump has
+     * changed the state by itself, the command has to be repeated.
+     */
+    bool is_state_lost();
+
+    void set_retry_policy(const ModbusRetryPolicy &policy);
+
+    /**
+     * False after a command has failed all its attempts or after
+     * PUMP_OFFLINE_STATUS_FAILURES status reads in a row, true after a reply
+     */
+    bool is_online();
+
+    /* Commands that have failed all their attempts, the status reads aren't counted */
+    uint16_t get_failed_count();
+
+    /**
+     * Error handler side: true once after a command has failed all its
+     * attempts, until the next call
+     */
+    bool take_command_failure();
+
+    /**
+     * Non-blocking start and stop. The request is queued from process()
+     * only after the previous Modbus transaction is completed, as one
+     * apply_setpoint().
+     */
+    void request_start(const float &rmp);
+    void request_stop(const float &idle_rmp);
+    bool is_busy();
+    bool is_stopping();
+
+    /* The queue itself is processed by the bus scheduler */
+    void process();
+
+    /**
+     * Stop for all the pumps of the model at once, send it with
+     * ModbusScheduler::broadcast() and call on_broadcast_stop() of every pump
+     */
+    static const uint8_t *get_broadcast_stop_frame();
+    static uint8_t get_broadcast_stop_frame_size();
+
+    /**
+     * Drops everything queued for the pump and forgets the confirmed state,
+     * nobody replies to a broadcast - the status read tells what the pump does
+     */
+    void on_broadcast_stop();
+
+private:
+    typedef typename Traits::SpeedEncoding SpeedEncoding;
+    typedef ModbusFrame<MODBUS_WRITE_REGISTER_FRAME_SIZE> CommandFrame;
+
+    /* Queue tags, one per pump register */
+    enum TransactionTag
+    {
+        TAG_STATE,
+        TAG_ROTATE_DIRECTION,
+        TAG_SPEED,
+        TAG_SETPOINT,
+        TAG_STATUS
+    };
+
+    static constexpr uint8_t SPEED_REGISTER_COUNT = SpeedEncoding::REGISTER_COUNT;
+
+    /* State, direction and speed can be written and read as one block */
+    static constexpr bool IS_SETPOINT_BLOCK =
+        Traits::DIRECTION_REGISTER == Traits::STATE_REGISTER + 1 &&
+        Traits::SPEED_REGISTER == Traits::STATE_REGISTER + 2;
+    static constexpr uint8_t SETPOINT_REGISTER_COUNT = 2 + SPEED_REGISTER_COUNT;
+
+    static constexpr bool HAS_SETPOINT_WRITE = IS_SETPOINT_BLOCK && Traits::HAS_WRITE_MULTIPLE_REGISTERS;
+    static constexpr bool HAS_STATUS_READ = IS_SETPOINT_BLOCK && Traits::HAS_READ_REGISTERS;
+
+    static_assert(SPEED_REGISTER_COUNT == 1 || Traits::HAS_WRITE_MULTIPLE_REGISTERS,
+                  "a speed in several registers needs FC16");
+    static_assert(SETPOINT_REGISTER_COUNT <= MODBUS_MAX_PAYLOAD,
+                  "the setpoint doesn't fit into a transaction");
+
+    struct CommandFrames
+    {
+        CommandFrame start;
+        CommandFrame stop;
+        CommandFrame clockwise;
+        CommandFrame counterclockwise;
+    };
+
+    /* One set per slave address in use */
+    template <uint8_t SlaveId>
+    static constexpr CommandFrames COMMAND_FRAMES PROGMEM = {
+        make_write_register_frame(SlaveId, Traits::STATE_REGISTER, Traits::STATE_ON),
+        make_write_register_frame(SlaveId, Traits::STATE_REGISTER, Traits::STATE_OFF),
+        make_write_register_frame(SlaveId, Traits::DIRECTION_REGISTER, Traits::DIRECTION_CLOCKWISE),
+        make_write_register_frame(SlaveId, Traits::DIRECTION_REGISTER, Traits::DIRECTION_COUNTERCLOCKWISE)
+    };
+
+    static constexpr CommandFrame BROADCAST_STOP_FRAME PROGMEM =
+        make_write_register_frame(0, Traits::STATE_REGISTER, Traits::STATE_OFF);
+
+    static uint16_t encode_state(const PumpStates &state)
+    {
+        return (state == PumpStates::ON) ? Traits::STATE_ON : Traits::STATE_OFF;
+    }
+
+    /* Anything but OFF means the pump is running */
+    static PumpStates decode_state(const uint16_t &value)
+    {
+        return (value != Traits::STATE_OFF) ? PumpStates::ON : PumpStates::OFF;
+    }
+
+    static uint16_t encode_direction(const RotateDirections &direction)
+    {
+        return (direction == CLOCKWISE) ? Traits::DIRECTION_CLOCKWISE : Traits::DIRECTION_COUNTERCLOCKWISE;
+    }
+
+    static RotateDirections decode_direction(const uint16_t &value)
+    {
+        return (value == Traits::DIRECTION_CLOCKWISE) ? CLOCKWISE : COUNTERCLOCKWISE;
+    }
+
+    modbus_t make_telegram(const uint8_t &function, const uint16_t &address, const uint16_t &count)
+    {
+        modbus_t telegram;
+        telegram.u8id = slave_id;           // slave address
+        telegram.u8fct = function;          // function code
+        telegram.u16RegAdd = address;       // start address in slave
+        telegram.u16CoilsNo = count;        // number of registers
+        telegram.au16reg = NULL;            // the queue points it to the transaction payload
+        return telegram;
+    }
+
+    void process_request();
+    void poll_status();
+
+    /* telegram and payload describe the query, frame is its prebuilt version if there is one */
+    bool send(const modbus_t &telegram, const uint16_t *payload,
+              const ModbusPriority &priority, const uint8_t &tag,
+              const uint8_t *frame = NULL);
+    static void on_transaction_done(const ModbusTransaction &transaction, const uint8_t &result, void *context);
+
+private:
+    ModbusQueue &queue;
+    uint8_t slave_id;
+
+    /* COMMAND_FRAMES of the slave address, in flash */
+    const CommandFrames *frames;
+
+    PumpStates pump_state = PumpStates::OFF;
+    float pump_rmp = 0;
+    RotateDirections pump_rotate_direction = CLOCKWISE;
+
+    /**
+     * This is an structe which contains a query to an slave device.
+     * Register values are carried by every transaction separately.
+     */
+    modbus_t state_tg;
+    modbus_t rotate_direction_tg;
+    modbus_t speed_tg;
+    modbus_t setpoint_tg;
+    modbus_t status_tg;
+
+    /**
+     * Values the pump has acknowledged, writes of the same value are skipped.
+     * Unknown until the first successful write.
+     */
+    bool is_state_confirmed = false;
+    PumpStates confirmed_state = PumpStates::OFF;
+    bool is_speed_confirmed = false;
+    float confirmed_rmp = 0;
+    bool is_rotate_direction_confirmed = false;
+    RotateDirections confirmed_rotate_direction = CLOCKWISE;
+
+    /* State, direction and speed as read from the pump */
+    bool is_pump_status_valid = false;
+    PumpStates actual_state = PumpStates::OFF;
+    float actual_rmp = 0;
+    uint32_t last_status_request_ms = 0;
+
+    ModbusRetryPolicy retry_policy = PUMP_RETRY_POLICY;
+    bool is_pump_online = false;
+    uint16_t failed_count = 0;
+    uint8_t failed_status_count = 0;
+    volatile bool is_command_failed = false;
+
+    /**
+     * Setpoint of request_start() or request_stop() waiting for the queue.
+     * The control task requests, the pump task sends, so both of them
+     * touch it in a critical section. request_id tells a request made
+     * while the previous one was being sent.
+     */
+    bool is_request_pending = false;
+    PumpStates requested_state = PumpStates::OFF;
+    float requested_rmp = 0;
+    uint8_t request_id = 0;
+};
+
+template <typename Traits>
+template <uint8_t SlaveId>
+PumpDriver<Traits>::PumpDriver(ModbusQueue &queue, ModbusSlaveId<SlaveId>)
+    : queue(queue), slave_id(SlaveId), frames(&COMMAND_FRAMES<SlaveId>)
+{
+    static_assert(SlaveId >= 1 && SlaveId <= 247, "a pump can't have a broadcast or reserved address");
+
+    state_tg = make_telegram(MB_FC_WRITE_REGISTER, Traits::STATE_REGISTER, 1);
+    rotate_direction_tg = make_telegram(MB_FC_WRITE_REGISTER, Traits::DIRECTION_REGISTER, 1);
+    speed_tg = make_telegram((SPEED_REGISTER_COUNT == 1) ? MB_FC_WRITE_REGISTER : MB_FC_WRITE_MULTIPLE_REGISTERS,
+                             Traits::SPEED_REGISTER, SPEED_REGISTER_COUNT);
+    setpoint_tg = make_telegram(MB_FC_WRITE_MULTIPLE_REGISTERS, Traits::STATE_REGISTER, SETPOINT_REGISTER_COUNT);
+    status_tg = make_telegram(MB_FC_READ_REGISTERS, Traits::STATE_REGISTER, SETPOINT_REGISTER_COUNT);
+}
+
+template <typename Traits>
+uint8_t PumpDriver<Traits>::get_slave_id()
+{
+    return slave_id;
+}
+
+template <typename Traits>
+const uint8_t *PumpDriver<Traits>::get_broadcast_stop_frame()
+{
+    return BROADCAST_STOP_FRAME.bytes;
+}
+
+template <typename Traits>
+uint8_t PumpDriver<Traits>::get_broadcast_stop_frame_size()
+{
+    return BROADCAST_STOP_FRAME.size();
+}
+
+template <typename Traits>
+void PumpDriver<Traits>::on_broadcast_stop()
+{
+    queue.clear();
+
+    pump_state = PumpStates::OFF;
+    is_state_confirmed = false;
+
+    taskENTER_CRITICAL();
+    is_request_pending = false;
+    taskEXIT_CRITICAL();
+}
+
+template <typename Traits>
+bool PumpDriver<Traits>::start()
+{
+    pump_state = PumpStates::ON;
+
+    /* The pump is already running, drop a queued stop if there is one */
+    if (is_state_confirmed && confirmed_state == PumpStates::ON && !queue.is_sending(TAG_STATE))
+    {
+        queue.cancel(TAG_STATE);
+        return true;
+    }
+
+    uint16_t state_data[1] = {Traits::STATE_ON};
+    return send(state_tg, state_data, MODBUS_PRIORITY_NORMAL, TAG_STATE, frames->start.bytes);
+}
+
+template <typename Traits>
+bool PumpDriver<Traits>::stop()
+{
+    pump_state = PumpStates::OFF;
+
+    if (is_state_confirmed && confirmed_state == PumpStates::OFF && !queue.is_sending(TAG_STATE))
+    {
+        queue.cancel(TAG_STATE);
+        return true;
+    }
+
+    /* Stop goes before everything else in the queue */
+    uint16_t state_data[1] = {Traits::STATE_OFF};
+    return send(state_tg, state_data, MODBUS_PRIORITY_HIGH, TAG_STATE, frames->stop.bytes);
+}
+
+template <typename Traits>
+bool PumpDriver<Traits>::set_speed(const float &rmp)
+{
+    pump_rmp = rmp;
+
+    if (is_speed_confirmed && confirmed_rmp == rmp && !queue.is_sending(TAG_SPEED))
+    {
+        queue.cancel(TAG_SPEED);
+        return true;
+    }
+
+    uint16_t speed_data[SPEED_REGISTER_COUNT];
+    SpeedEncoding::encode(pump_rmp, speed_data);
+
+    /* Only the newest speed matters, it replaces a queued one */
+    return send(speed_tg, speed_data, MODBUS_PRIORITY_LOW, TAG_SPEED);
+}
+
+template <typename Traits>
+float PumpDriver<Traits>::get_speed()
+{
+    return pump_rmp;
+}
+
+template <typename Traits>
+float PumpDriver<Traits>::get_actual_speed()
+{
+    if (!is_pump_status_valid)
+        return pump_rmp;
+
+    return (actual_state == PumpStates::ON) ? actual_rmp : 0;
+}
+
+template <typename Traits>
+PumpStates PumpDriver<Traits>::get_actual_state()
+{
+    return is_pump_status_valid ? actual_state : pump_state;
+}
+
+template <typename Traits>
+bool PumpDriver<Traits>::is_status_valid()
+{
+    return is_pump_status_valid;
+}
+
+template <typename Traits>
+bool PumpDriver<Traits>::is_state_lost()
+{
+    if (is_busy())
+        return false;
+
+    if (queue.contains(TAG_STATE) || queue.is_sending(TAG_STATE) ||
+        queue.contains(TAG_SETPOINT) || queue.is_sending(TAG_SETPOINT))
+        return false;
+
+    return !is_state_confirmed || confirmed_state != pump_state;
+}
+
+template <typename Traits>
+void PumpDriver<Traits>::set_rotate_direction(const RotateDirections &direction)
+{
+    pump_rotate_direction = direction;
+
+    if (is_rotate_direction_confirmed && confirmed_rotate_direction == direction &&
+        !queue.is_sending(TAG_ROTATE_DIRECTION))
+    {
+        queue.cancel(TAG_ROTATE_DIRECTION);
+        return;
+    }
+
+    uint16_t rotate_direction_data[1] = {encode_direction(direction)};
+    const uint8_t *frame = (direction == CLOCKWISE) ? frames->clockwise.bytes : frames->counterclockwise.bytes;
+    send(rotate_direction_tg, rotate_direction_data, MODBUS_PRIORITY_NORMAL, TAG_ROTATE_DIRECTION, frame);
+}
+
+template <typename Traits>
+PumpStates PumpDriver<Traits>::get_state()
+{
+    return pump_state;
+}
+
+template <typename Traits>
+bool PumpDriver<Traits>::apply_setpoint(const PumpStates &state, const RotateDirections &direction, const float &rmp)
+{
+    bool is_batch = false;
+
+    if constexpr (HAS_SETPOINT_WRITE)
+    {
+        bool is_state_changed = !(is_state_confirmed && confirmed_state == state);
+        bool is_direction_changed = !(is_rotate_direction_confirmed && confirmed_rotate_direction == direction);
+        bool is_speed_changed = !(is_speed_confirmed && confirmed_rmp == rmp);
+
+        /* A register being written now may end up with the old value */
+        is_state_changed = is_state_changed || queue.is_sending(TAG_STATE);
+        is_direction_changed = is_direction_changed || queue.is_sending(TAG_ROTATE_DIRECTION);
+        is_speed_changed = is_speed_changed || queue.is_sending(TAG_SPEED);
+
+        uint8_t changed_count = is_state_changed + is_direction_changed + is_speed_changed;
+        is_batch = changed_count > 1 || queue.is_sending(TAG_SETPOINT);
+    }
+
+    /* One register or none - the usual single writes, they skip what is confirmed */
+    if (!is_batch)
+    {
+        bool is_sent = true;
+
+        if (state == PumpStates::OFF)
+            is_sent = stop() && is_sent;
+
+        set_rotate_direction(direction);
+        is_sent = set_speed(rmp) && is_sent;
+
+        if (state == PumpStates::ON)
+            is_sent = start() && is_sent;
+
+        return is_sent;
+    }
+
+    pump_state = state;
+    pump_rotate_direction = direction;
+    pump_rmp = rmp;
+
+    /* The batch replaces the single writes queued before it */
+    queue.cancel(TAG_STATE);
+    queue.cancel(TAG_ROTATE_DIRECTION);
+    queue.cancel(TAG_SPEED);
+
+    uint16_t setpoint_data[SETPOINT_REGISTER_COUNT];
+    setpoint_data[0] = encode_state(state);
+    setpoint_data[1] = encode_direction(direction);
+    SpeedEncoding::encode(rmp, &setpoint_data[2]);
+
+    ModbusPriority priority = (state == PumpStates::OFF) ? MODBUS_PRIORITY_HIGH : MODBUS_PRIORITY_NORMAL;
+    return send(setpoint_tg, setpoint_data, priority, TAG_SETPOINT);
+}
+
+template <typename Traits>
+void PumpDriver<Traits>::set_retry_policy(const ModbusRetryPolicy &policy)
+{
+    retry_policy = policy;
+}
+
+template <typename Traits>
+bool PumpDriver<Traits>::is_online()
+{
+    return is_pump_online;
+}
+
+template <typename Traits>
+uint16_t PumpDriver<Traits>::get_failed_count()
+{
+    return failed_count;
+}
+
+template <typename Traits>
+bool PumpDriver<Traits>::take_command_failure()
+{
+    taskENTER_CRITICAL();
+    bool is_failed = is_command_failed;
+    is_command_failed = false;
+    taskEXIT_CRITICAL();
+
+    return is_failed;
+}
+
+/**
+ * Set the speed and start the pump, in one frame if both have to be written.
+ * Ignored while another request is pending.
+ */
+template <typename Traits>
+void PumpDriver<Traits>::request_start(const float &rmp)
+{
+    taskENTER_CRITICAL();
+
+    if (!is_request_pending)
+    {
+        requested_state = PumpStates::ON;
+        requested_rmp = rmp;
+        is_request_pending = true;
+        ++request_id;
+    }
+
+    taskEXIT_CRITICAL();
+}
+
+/**
+ * Stop the pump and set the idle speed for the next start.
+ * Replaces a pending request, stopping must not wait behind a start.
+ */
+template <typename Traits>
+void PumpDriver<Traits>::request_stop(const float &idle_rmp)
+{
+    taskENTER_CRITICAL();
+    requested_state = PumpStates::OFF;
+    requested_rmp = idle_rmp;
+    is_request_pending = true;
+    ++request_id;
+    taskEXIT_CRITICAL();
+}
+
+template <typename Traits>
+bool PumpDriver<Traits>::is_busy()
+{
+    taskENTER_CRITICAL();
+    bool is_pending = is_request_pending;
+    taskEXIT_CRITICAL();
+
+    return is_pending;
+}
+
+template <typename Traits>
+bool PumpDriver<Traits>::is_stopping()
+{
+    taskENTER_CRITICAL();
+    bool is_stop_pending = is_request_pending && requested_state == PumpStates::OFF;
+    taskEXIT_CRITICAL();
+
+    return is_stop_pending;
+}
+
+template <typename Traits>
+void PumpDriver<Traits>::process_request()
+{
+    taskENTER_CRITICAL();
+    bool is_pending = is_request_pending;
+    PumpStates state = requested_state;
+    float rmp = requested_rmp;
+    uint8_t id = request_id;
+    taskEXIT_CRITICAL();
+
+    if (!is_pending)
+        return;
+
+    /* The previous command is still in the queue or waiting for the reply */
+    if (!queue.is_idle())
+        return;
+
+    if (!apply_setpoint(state, pump_rotate_direction, rmp))
+        return;
+
+    /* A request made meanwhile is sent by the next call */
+    taskENTER_CRITICAL();
+    if (request_id == id)
+        is_request_pending = false;
+    taskEXIT_CRITICAL();
+}
+
+template <typename Traits>
+void PumpDriver<Traits>::process()
+{
+    process_request();
+    poll_status();
+}
+
+/* Reads the pump registers back in the gaps between the commands */
+template <typename Traits>
+void PumpDriver<Traits>::poll_status()
+{
+    if constexpr (HAS_STATUS_READ)
+    {
+        uint16_t period_ms = is_pump_online ? PUMP_STATUS_PERIOD_MS : PUMP_OFFLINE_STATUS_PERIOD_MS;
+
+        if (millis() - last_status_request_ms < period_ms)
+            return;
+
+        if (!queue.is_idle() || is_busy())
+            return;
+
+        /* The next read comes soon anyway, no need to retry this one */
+        ModbusRetryPolicy status_retry_policy = retry_policy;
+        status_retry_policy.max_attempts = 1;
+
+        ModbusTransaction transaction;
+        transaction.telegram = status_tg;
+        transaction.frame = NULL;
+        transaction.frame_size = 0;
+        transaction.priority = MODBUS_PRIORITY_IDLE;
+        transaction.tag = TAG_STATUS;
+        transaction.is_latest_wins = true;
+        transaction.retry = status_retry_policy;
+        transaction.callback = on_transaction_done;
+        transaction.context = this;
+
+        if (queue.push(transaction))
+            last_status_request_ms = millis();
+    }
+}
+
+template <typename Traits>
+bool PumpDriver<Traits>::send(const modbus_t &telegram, const uint16_t *payload,
+                              const ModbusPriority &priority, const uint8_t &tag,
+                              const uint8_t *frame)
+{
+    ModbusTransaction transaction;
+    transaction.telegram = telegram;
+    transaction.frame = frame;
+    transaction.frame_size = (frame != NULL) ? MODBUS_WRITE_REGISTER_FRAME_SIZE : 0;
+
+    for (uint8_t i = 0; i < telegram.u16CoilsNo; ++i)
+        transaction.payload[i] = payload[i];
+
+    transaction.priority = priority;
+    transaction.tag = tag;
+    transaction.is_latest_wins = true;
+    transaction.retry = retry_policy;
+    transaction.callback = on_transaction_done;
+    transaction.context = this;
+
+    return queue.push(transaction);
+}
+
+template <typename Traits>
+void PumpDriver<Traits>::on_transaction_done(const ModbusTransaction &transaction, const uint8_t &result, void *context)
+{
+    PumpDriver *pump = (PumpDriver *)context;
+
+    /**
+     * The master has matched the reply with this transaction (slave, function,
+     * echoed register and value) and checked its CRC before the callback.
+     * The payload is exactly what was sent, not what was requested after it.
+     */
+    bool is_confirmed = (result == 0);
+
+    /* A failed status read is tried again soon, a few in a row mean the pump is gone */
+    if (transaction.tag == TAG_STATUS && !is_confirmed)
+    {
+        if (pump->failed_status_count < PUMP_OFFLINE_STATUS_FAILURES)
+            ++pump->failed_status_count;
+
+        if (pump->failed_status_count == PUMP_OFFLINE_STATUS_FAILURES)
+            pump->is_pump_online = false;
+    }
+    /* A command has failed all its attempts, task_handle_error takes it */
+    else if (!is_confirmed)
+    {
+        ++pump->failed_count;
+        pump->is_command_failed = true;
+        pump->is_pump_online = false;
+    }
+    else
+    {
+        pump->failed_status_count = 0;
+        pump->is_pump_online = true;
+    }
+
+    switch (transaction.tag)
+    {
+    case TAG_STATE:
+        pump->is_state_confirmed = is_confirmed;
+        pump->confirmed_state = decode_state(transaction.payload[0]);
+        break;
+    case TAG_ROTATE_DIRECTION:
+        pump->is_rotate_direction_confirmed = is_confirmed;
+        pump->confirmed_rotate_direction = decode_direction(transaction.payload[0]);
+        break;
+    case TAG_SPEED:
+        pump->is_speed_confirmed = is_confirmed;
+        pump->confirmed_rmp = SpeedEncoding::decode(transaction.payload);
+        break;
+    case TAG_SETPOINT:
+        pump->is_state_confirmed = is_confirmed;
+        pump->confirmed_state = decode_state(transaction.payload[0]);
+        pump->is_rotate_direction_confirmed = is_confirmed;
+        pump->confirmed_rotate_direction = decode_direction(transaction.payload[1]);
+        pump->is_speed_confirmed = is_confirmed;
+        pump->confirmed_rmp = SpeedEncoding::decode(&transaction.payload[2]);
+        break;
+    case TAG_STATUS:
+        pump->is_pump_status_valid = is_confirmed;
+
+        if (!is_confirmed)
+            break;
+
+        /* The pump knows better than the last write what it is doing */
+        pump->actual_state = decode_state(transaction.payload[0]);
+        pump->actual_rmp = SpeedEncoding::decode(&transaction.payload[2]);
+
+        pump->is_state_confirmed = true;
+        pump->confirmed_state = pump->actual_state;
+        pump->is_rotate_direction_confirmed = true;
+        pump->confirmed_rotate_direction = decode_direction(transaction.payload[1]);
+        pump->is_speed_confirmed = true;
+        pump->confirmed_rmp = pump->actual_rmp;
+        break;
+    }
+}
+
+#endif
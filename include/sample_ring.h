@@ -0,0 +1,83 @@
+#ifndef sample_ring_h
+#define sample_ring_h
+
+#include <stdint.h>
+
+/**
+ * Lock-free single-producer/single-consumer ring buffer.
+ *
+ * The producer (an ISR or a task) only moves head, the consumer only moves
+ * tail. Both indexes are single bytes, so on AVR every index store is atomic
+ * and no critical section is needed. Size must be a power of two, one slot
+ * is kept free to tell a full ring from an empty one.
+ */
+template <typename T, uint8_t Size>
+class SampleRing {
+    static_assert(Size >= 2 && (Size & (Size - 1)) == 0,
+                  "SampleRing size must be a power of two");
+
+public:
+    /* Producer side */
+    bool push(const T& item) {
+        uint8_t next = (head + 1) & (Size - 1);
+
+        if (next == tail) {
+            ++overflow_count;
+            return false;
+        }
+
+        buffer[head] = item;
+
+        /* The item must be in memory before the consumer sees the new head */
+        __asm__ __volatile__("" ::: "memory");
+        head = next;
+
+        return true;
+    }
+
+    /* Consumer side */
+    bool pop(T& item) {
+        uint8_t current_tail = tail;
+
+        if (current_tail == head)
+            return false;
+
+        item = buffer[current_tail];
+
+        __asm__ __volatile__("" ::: "memory");
+        tail = (current_tail + 1) & (Size - 1);
+
+        return true;
+    }
+
+    /* Consumer side, returns the number of items copied to items */
+    uint8_t pop_batch(T* items, const uint8_t& max_count) {
+        uint8_t count = 0;
+
+        while (count < max_count && pop(items[count]))
+            ++count;
+
+        return count;
+    }
+
+    /* Consumer side, drops everything that is currently in the ring */
+    void clear() {
+        tail = head;
+    }
+
+    uint8_t size() const {
+        return (head - tail) & (Size - 1);
+    }
+
+    uint16_t get_overflow_count() const {
+        return overflow_count;
+    }
+
+private:
+    T buffer[Size];
+    volatile uint8_t head = 0;
+    volatile uint8_t tail = 0;
+    volatile uint16_t overflow_count = 0;
+};
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef scada_slave_h
+#define scada_slave_h
+
+#include <Arduino.h>
+#include <Arduino_FreeRTOS.h>
+#include "ModbusRtu.h"
+
+/**
+ * Holding registers of the SCADA slave, one int16 each.
+ * The read only block is a snapshot of the last control cycle,
+ * the setpoints can be written with FC6/FC16.
+ */
+enum ScadaRegister
+{
+    SCADA_PRESSURE,             // mmHg * 10
+    SCADA_TEMPERATURE1,         // °C * 10
+    SCADA_TEMPERATURE2,         // °C * 10
+    SCADA_FLOW,                 // * 10, pump speed * perfusion ratio
+    SCADA_PUMP_SPEED,           // rpm * 10, as read back from the pump
+    SCADA_REGIME,               // Regime
+    SCADA_KIDNEY,               // KidneyState
+    SCADA_IS_BLOCKED,           // 0 or 1
+    SCADA_ALERTS,               // bit n - 1 is AlertType n, as in the telemetry
+    SCADA_PERIPHERAL_STATUS,    // PeripheralStatus::pack_to_byte()
+    SCADA_SESSION_MINUTES,
+    SCADA_SESSION_SECONDS,
+
+    /* Setpoints, the same as the CLI commands */
+    SCADA_TARGET_PRESSURE = 16, // mmHg, set_tv
+    SCADA_TEMP_LOW_LIMIT,       // °C * 10, temp_low_limit
+    SCADA_TEMP_HIGH_LIMIT,      // °C * 10, temp_high_limit
+    SCADA_PERFUSION_RATIO,      // * 1000, set_perfusion_speed_ratio
+
+    SCADA_REGISTER_COUNT
+};
+
+const uint8_t SCADA_FIRST_SETPOINT = SCADA_TARGET_PRESSURE;
+const uint8_t SCADA_SETPOINT_COUNT = SCADA_REGISTER_COUNT - SCADA_FIRST_SETPOINT;
+
+struct ScadaSetpointRange
+{
+    int16_t min;
+    int16_t max;
+};
+
+/**
+ * Values a master may write, in the units of the registers. A write with
+ * a value outside, or a write of a temperature limit that leaves the low
+ * one not below the high one, is refused with ILLEGAL DATA VALUE.
+ */
+const ScadaSetpointRange SCADA_SETPOINT_RANGES[SCADA_SETPOINT_COUNT] = {
+    {0, 100},       // target pressure, mmHg
+    {0, 400},       // low temperature limit, 0..40 °C
+    {0, 400},       // high temperature limit, 0..40 °C
+    {1, 5000}       // perfusion ratio, 0.001..5
+};
+
+/**
+ * Modbus RTU slave for the plant SCADA.
+ *
+ * The control task publishes a snapshot of all the registers once per
+ * cycle, it only copies a few dozen bytes and never waits for the bus.
+ * The slave task takes the newest snapshot before every poll, so
+ * a request always sees the values of one and the same cycle.
+ */
+class ScadaSlave
+{
+public:
+    ScadaSlave(Stream &port, const uint8_t &id);
+
+    void begin(const uint32_t &baud_rate);
+
+    /* Control task side */
+    void publish(const int16_t *registers);
+
+    /**
+     * Slave task side: answers a request if there is one.
+     * Returns a bit mask of the setpoints the master has changed,
+     * bit n is register SCADA_FIRST_SETPOINT + n. The changed values
+     * are within SCADA_SETPOINT_RANGES.
+     */
+    uint8_t poll();
+
+    int16_t get_register(const uint8_t &address);
+
+private:
+    /* Modbus write check, the setpoints as they would be after the write */
+    static boolean check_setpoints(uint16_t start, uint16_t count, const uint16_t *values, void *context);
+
+    Modbus slave;
+
+    uint16_t registers[SCADA_REGISTER_COUNT];
+
+    uint16_t snapshot[SCADA_REGISTER_COUNT];
+    volatile bool is_snapshot_new = false;
+};
+
+#endif
@@ -0,0 +1,281 @@
+#ifndef telemetry_h
+#define telemetry_h
+
+#include <stdint.h>
+#include <math.h>
+#include "ModbusCrc.h"
+#include "BaseParams/Pressure.h"
+
+/**
+ * Values of one telemetry frame, taken at the end of a control cycle.
+ * The frame itself is packed from the snapshot by the telemetry task,
+ * not by the timer ISR.
+ */
+struct TelemetrySnapshot
+{
+    float flow;                 // pump speed * perfusion ratio
+    float pressure;             // mmHg
+    float temperature1;         // °C
+    float temperature2;         // °C
+    uint8_t packed_state;       // regime | kidney_selector << 3 | is_blocked << 4
+    uint8_t alerts;             // bit n - 1 is AlertType n
+    uint8_t peripheral_status;  // PeripheralStatus::pack_to_byte()
+    float target;               // mmHg
+};
+
+/* 4 floats, time, packed state, alerts, peripheral status, target */
+const uint8_t TELEMETRY_STATUS_PAYLOAD_SIZE = 26;
+
+enum TelemetryMode
+{
+    TELEMETRY_MODE_LEGACY,      // the status payload and '\n'
+    TELEMETRY_MODE_FRAMED       // see TelemetryFramer
+};
+
+/**
+ * Framed telemetry, protocol version 1:
+ *
+ *   COBS(version, type, sequence, payload..., CRC low, CRC high), 0x00
+ *
+ * COBS leaves no zero bytes in the frame, so 0x00 only ends a frame and
+ * the host resynchronizes on the next one after a lost or corrupted byte.
+ * The CRC is crc16() of the Modbus library over version, type, sequence
+ * and payload. The sequence counts all the frames, a gap means lost ones.
+ */
+const uint8_t TELEMETRY_PROTOCOL_VERSION = 1;
+
+enum TelemetryFrameType
+{
+    TELEMETRY_FRAME_STATUS = 1,         // the status payload, as in the legacy mode
+    TELEMETRY_FRAME_MODBUS_STATS = 2,   // pump bus counters, see pack_modbus_stats_payload()
+    TELEMETRY_FRAME_STREAM = 3,         // decimated fields, see TelemetryField
+    TELEMETRY_FRAME_STREAM_KEY = 4,     // the same, compact, see TelemetryDeltaEncoder
+    TELEMETRY_FRAME_STREAM_DELTA = 5,
+    TELEMETRY_FRAME_CAPTURE = 6         // raw pressure samples, see send_capture_frames()
+};
+
+const uint8_t TELEMETRY_HEADER_SIZE = 3;
+const uint8_t TELEMETRY_MAX_PAYLOAD = 32;
+
+/* 11 counters, uint16 each */
+const uint8_t TELEMETRY_MODBUS_STATS_PAYLOAD_SIZE = 22;
+
+/* Header, CRC, COBS code byte (one per 254 bytes of data) and the delimiter */
+const uint8_t TELEMETRY_FRAME_OVERHEAD = TELEMETRY_HEADER_SIZE + 2 + 1 + 1;
+const uint8_t TELEMETRY_MAX_FRAME_SIZE = TELEMETRY_MAX_PAYLOAD + TELEMETRY_FRAME_OVERHEAD;
+
+/**
+ * Stream frames carry the pressure at up to TELEMETRY_STREAM_RATE_HZ,
+ * independently of the 1 Hz session clock and the status frames.
+ * The time line is split into slots of 1 / TELEMETRY_STREAM_RATE_HZ,
+ * a slot is taken by the first pressure sample completed in it. Every
+ * field has its own decimation ratio: ratio n - the field goes in the
+ * slots whose number is divisible by n, 0 - the field isn't streamed.
+ *
+ * TELEMETRY_FRAME_STREAM payload: slot (uint16, little endian), field mask
+ * (bit n - TelemetryField n), then the fields of the mask in that order.
+ * The slots without a frame are skipped, the host gets the time of a
+ * frame from its slot number.
+ */
+const uint8_t TELEMETRY_STREAM_RATE_HZ = 100;
+const uint32_t TELEMETRY_STREAM_SLOT_US = 1000000UL / TELEMETRY_STREAM_RATE_HZ;
+
+enum TelemetryField
+{
+    TELEMETRY_FIELD_PRESSURE,       // float, mmHg, the value the PID sees
+    TELEMETRY_FIELD_PRESSURE_MEAN,  // float, mmHg, the trimmed mean before the smoothing
+    TELEMETRY_FIELD_FLOW,           // float
+    TELEMETRY_FIELD_TEMPERATURE1,   // float, °C
+    TELEMETRY_FIELD_TEMPERATURE2,   // float, °C
+    TELEMETRY_FIELD_TARGET,         // float, mmHg
+    TELEMETRY_FIELD_STATE,          // packed state, alerts, peripheral status
+    TELEMETRY_FIELD_COUNT
+};
+
+const uint8_t TELEMETRY_STREAM_HEADER_SIZE = 3;
+
+constexpr uint8_t telemetry_field_size(const uint8_t &field)
+{
+    return (field == TELEMETRY_FIELD_STATE) ? 3 : 4;
+}
+
+static_assert(TELEMETRY_STREAM_HEADER_SIZE + (TELEMETRY_FIELD_COUNT - 1) * 4 + 3 <= TELEMETRY_MAX_PAYLOAD,
+              "Stream frame with all the fields doesn't fit into a telemetry frame");
+
+/* CLI names of the fields, from_name returns false for an unknown one */
+const char *telemetry_field_name(const uint8_t &field);
+bool telemetry_field_from_name(const char *name, TelemetryField &field);
+
+/* Pressure values of one stream slot, taken by the control task */
+struct TelemetryPressurePoint
+{
+    uint16_t slot;
+    pressure_t pressure;
+    pressure_t pressure_mean;
+};
+
+/** Numbers the stream slots on the time line of the pressure samples */
+class TelemetryStreamClock
+{
+public:
+    /* true if the sample is the first one in its slot */
+    bool advance(const uint32_t &timestamp_us, uint16_t &slot);
+
+private:
+    uint32_t next_slot_us = 0;
+    uint16_t current_slot = 0;
+    bool is_started = false;
+};
+
+class TelemetryDecimator
+{
+public:
+    /* ratio 0 - the field isn't streamed */
+    void set_ratio(const TelemetryField &field, const uint8_t &ratio);
+    uint8_t get_ratio(const TelemetryField &field) const;
+
+    /* At least one field is streamed */
+    bool is_enabled() const;
+
+    /* Bit n - TelemetryField n is streamed */
+    uint8_t get_enabled_mask() const;
+
+    /* Bit n - TelemetryField n goes in this slot */
+    uint8_t get_due_mask(const uint16_t &slot) const;
+
+    /* Bytes a second the stream frames take on the wire, if every slot has a sample */
+    uint16_t get_bytes_per_second() const;
+
+private:
+    volatile uint8_t ratios[TELEMETRY_FIELD_COUNT] = {0};
+};
+
+/* Returns the encoded size, encoded has to hold size + size / 254 + 1 bytes */
+uint8_t cobs_encode(const uint8_t *data, const uint8_t &size, uint8_t *encoded);
+
+class TelemetryFramer
+{
+public:
+    /**
+     * Builds the frame with the delimiter into frame (TELEMETRY_MAX_FRAME_SIZE bytes).
+     * Returns its size, 0 if the payload is longer than TELEMETRY_MAX_PAYLOAD.
+     */
+    uint8_t build(const TelemetryFrameType &type, const uint8_t *payload, const uint8_t &size, uint8_t *frame);
+
+    /* Sequence number of the next frame */
+    uint8_t get_sequence() const;
+
+private:
+    uint8_t sequence = 0;
+};
+
+/**
+ * Compact stream frames. Every field is quantized to 1 / telemetry_field_scale()
+ * of its unit, about the step of its sensor, and sent as a difference,
+ * one byte most of the time instead of a 4 byte float.
+ *
+ * TELEMETRY_FRAME_STREAM_KEY: one slot - slot (uint16), field mask, then
+ * the fields of the mask as int32, little endian. A keyframe carries every
+ * field being streamed, so each field of a delta has a value to refer to.
+ *
+ * TELEMETRY_FRAME_STREAM_DELTA: sequence of its keyframe, then the slots
+ * up to the end of the payload, each as field mask, slot offset (varint)
+ * and the fields as zigzag varint differences. If the offset is 1 the
+ * mask has TELEMETRY_DELTA_NEXT_SLOT set and the offset is left out. The
+ * points of one control cycle go in one frame and share its header and CRC.
+ *
+ * The first slot of a delta frame refers to the keyframe: its offset is
+ * slot - key slot and its fields value - key value. Each next slot refers
+ * to the slot before it in the same frame, and each field to the last
+ * value of that field in the frame, or to the key value if the frame
+ * doesn't have it yet.
+ *
+ * The state field is its 3 raw bytes in both. A delta frame refers only
+ * to the keyframe and to itself, so a lost delta loses only itself. The
+ * deltas of a lost keyframe are dropped by the host, their key sequence
+ * doesn't match the last keyframe it has.
+ *
+ * Varint: 7 bits per byte, the low ones first, the high bit is set in
+ * every byte but the last. Zigzag: 0, -1, 1, -2, 2... -> 0, 1, 2, 3, 4...
+ */
+const uint8_t TELEMETRY_VARINT_MAX_SIZE = 5;
+const uint8_t TELEMETRY_DELTA_NEXT_SLOT = 0x80;
+
+static_assert(TELEMETRY_FIELD_COUNT < 8, "The field mask of a delta slot has no room for TELEMETRY_DELTA_NEXT_SLOT");
+
+/**
+ * Steps per unit of every field: pressures in 0.25 mmHg, just under one
+ * ADC count (0.3125), temperatures in 1/16 °C as DS18B20 measures them,
+ * the flow in 0.01.
+ */
+constexpr uint8_t telemetry_field_scale(const uint8_t &field)
+{
+    return (field == TELEMETRY_FIELD_TEMPERATURE1 || field == TELEMETRY_FIELD_TEMPERATURE2) ? 16
+           : (field == TELEMETRY_FIELD_FLOW) ? 100
+           : (field == TELEMETRY_FIELD_STATE) ? 1
+           : 4;
+}
+
+inline int32_t telemetry_quantize(const uint8_t &field, const float &value)
+{
+    return lround(value * telemetry_field_scale(field));
+}
+
+inline uint32_t zigzag_encode(const int32_t &value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+/* Returns the encoded size, up to TELEMETRY_VARINT_MAX_SIZE bytes */
+uint8_t varint_encode(uint32_t value, uint8_t *encoded);
+
+class TelemetryDeltaEncoder
+{
+public:
+    /* A keyframe every key_interval frames, 0 - the compact frames are off */
+    void set_key_interval(const uint8_t &interval);
+    uint8_t get_key_interval() const;
+
+    /**
+     * Adds a slot to the frame being packed.
+     * values - all the fields quantized, the state is
+     * packed_state | alerts << 8 | peripheral_status << 16.
+     * streamed_mask - the fields being streamed, a keyframe carries all of them.
+     * sequence - of the next frame, it becomes the key sequence.
+     * Returns false if the slot goes in the next frame: take this one with
+     * finish() and add the slot again.
+     */
+    bool add(const uint16_t &slot, const uint8_t &mask, const uint8_t &streamed_mask,
+             const int32_t *values, const uint8_t &sequence);
+
+    bool is_empty() const;
+
+    /* The packed payload, valid until the next add() */
+    const uint8_t *finish(TelemetryFrameType &type, uint8_t &size);
+
+private:
+    void add_key(const uint16_t &slot, const uint8_t &mask, const int32_t *values, const uint8_t &sequence);
+
+    /* Returns the size, up to the size of encoded */
+    uint8_t pack_delta(const uint16_t &slot, const uint8_t &mask, const int32_t *values, uint8_t *encoded);
+
+private:
+    volatile uint8_t key_interval = 0;
+    volatile bool has_key = false;
+    uint8_t frames_since_key = 0;
+
+    uint8_t key_sequence = 0;
+    uint16_t key_slot = 0;
+    uint8_t key_mask = 0;
+    int32_t key_values[TELEMETRY_FIELD_COUNT];
+
+    /* What the next slot of the frame being packed refers to */
+    uint16_t reference_slot = 0;
+    int32_t reference_values[TELEMETRY_FIELD_COUNT];
+
+    uint8_t payload[TELEMETRY_MAX_PAYLOAD];
+    uint8_t payload_size = 0;
+    TelemetryFrameType payload_type = TELEMETRY_FRAME_STREAM_DELTA;
+};
+
+#endif
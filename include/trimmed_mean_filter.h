@@ -0,0 +1,146 @@
+#ifndef trimmed_mean_filter_h
+#define trimmed_mean_filter_h
+
+#include <stdint.h>
+
+/**
+ * Sliding window trimmed mean.
+ *
+ * Keeps the last window_size values twice: in arrival order (to know which
+ * one leaves the window) and sorted (to know which ones to throw away).
+ * Every push evicts the oldest value and inserts the new one into the sorted
+ * array with a binary search and a shift, so it costs O(N) instead of
+ * sorting the whole window.
+ *
+ * trim_percent values are cut from each side of the sorted window before
+ * averaging. If nothing is left after trimming the median is returned.
+ *
+ * T   - sample type
+ * Sum - accumulator type, must hold MaxSize samples without overflow
+ */
+template <typename T, typename Sum, uint8_t MaxSize>
+class TrimmedMeanFilter {
+    static_assert(MaxSize >= 1, "TrimmedMeanFilter needs at least one slot");
+
+public:
+    TrimmedMeanFilter(const uint8_t& window_size = MaxSize,
+                      const uint8_t& trim_percent = 0) {
+        configure(window_size, trim_percent);
+    }
+
+    /* Returns false and keeps the old settings if they are out of range */
+    bool configure(const uint8_t& window_size, const uint8_t& trim_percent) {
+        if (window_size == 0 || window_size > MaxSize || trim_percent > 50)
+            return false;
+
+        this->window_size = window_size;
+        this->trim_percent = trim_percent;
+        reset();
+
+        return true;
+    }
+
+    void reset() {
+        count = 0;
+        oldest = 0;
+    }
+
+    /* Adds a value to the window and returns the new filtered value */
+    T push(const T& value) {
+        if (count < window_size) {
+            history[count] = value;
+            insert_sorted(count, value);
+            ++count;
+        }
+        else {
+            remove_sorted(history[oldest]);
+            insert_sorted(count - 1, value);
+
+            history[oldest] = value;
+            oldest = (oldest + 1 < window_size) ? oldest + 1 : 0;
+        }
+
+        return get_value();
+    }
+
+    T get_value() const {
+        if (count == 0)
+            return T();
+
+        uint8_t trim = (uint16_t)count * trim_percent / 100;
+
+        /* Too few values are left after trimming, take the median */
+        if (2 * trim >= count)
+            trim = (count - 1) / 2;
+
+        uint8_t first = trim;
+        uint8_t last = count - trim;
+
+        Sum sum = 0;
+        for (uint8_t i = first; i < last; ++i)
+            sum += sorted[i];
+
+        return sum / (last - first);
+    }
+
+    bool is_full() const {
+        return count == window_size;
+    }
+
+    uint8_t get_window_size() const {
+        return window_size;
+    }
+
+    uint8_t get_trim_percent() const {
+        return trim_percent;
+    }
+
+private:
+    /* Inserts value into sorted[0..size] keeping it sorted */
+    void insert_sorted(const uint8_t& size, const T& value) {
+        uint8_t low = 0;
+        uint8_t high = size;
+
+        while (low < high) {
+            uint8_t middle = (low + high) / 2;
+
+            if (sorted[middle] <= value)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+
+        for (uint8_t i = size; i > low; --i)
+            sorted[i] = sorted[i - 1];
+
+        sorted[low] = value;
+    }
+
+    /* Removes one copy of value from sorted[0..count) */
+    void remove_sorted(const T& value) {
+        uint8_t low = 0;
+        uint8_t high = count;
+
+        while (low < high) {
+            uint8_t middle = (low + high) / 2;
+
+            if (sorted[middle] < value)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+
+        for (uint8_t i = low; i + 1 < count; ++i)
+            sorted[i] = sorted[i + 1];
+    }
+
+private:
+    T history[MaxSize];
+    T sorted[MaxSize];
+    uint8_t count = 0;
+    uint8_t oldest = 0;
+    uint8_t window_size = MaxSize;
+    uint8_t trim_percent = 0;
+};
+
+#endif
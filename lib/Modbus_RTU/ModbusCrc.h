@@ -0,0 +1,41 @@
+/**
+ * @file 	ModbusCrc.h
+ *
+ * @description
+ *  CRC16/MODBUS of the RTU frames. It doesn't depend on Arduino, so it
+ *  builds for the native tests as well.
+ */
+
+#ifndef MODBUS_CRC_H
+#define MODBUS_CRC_H
+
+#include <inttypes.h>
+
+/**
+ * @def MODBUS_CRC_MODE
+ * @brief
+ * CRC16 implementation used for every TX and RX frame.
+ * Can be overridden from the build flags, e.g. -DMODBUS_CRC_MODE=MODBUS_CRC_NIBBLE
+ *
+ * MODBUS_CRC_BITWISE : 8 shift/xor iterations per byte, no table
+ * MODBUS_CRC_NIBBLE  : 2 lookups per byte in a 16 entry table, 32 bytes of flash
+ * MODBUS_CRC_TABLE   : 1 lookup per byte in a 256 entry table, 512 bytes of flash
+ */
+#define MODBUS_CRC_BITWISE  0
+#define MODBUS_CRC_NIBBLE   1
+#define MODBUS_CRC_TABLE    2
+
+#ifndef MODBUS_CRC_MODE
+#define MODBUS_CRC_MODE  MODBUS_CRC_TABLE
+#endif
+
+/**
+ * CRC16/MODBUS of a byte array. The low byte of the result goes first on the line.
+ * All the variants give the same result, crc16() is the one selected by MODBUS_CRC_MODE.
+ */
+uint16_t crc16Bitwise( const uint8_t *au8data, uint16_t u16length );
+uint16_t crc16Nibble( const uint8_t *au8data, uint16_t u16length );
+uint16_t crc16Table( const uint8_t *au8data, uint16_t u16length );
+uint16_t crc16( const uint8_t *au8data, uint16_t u16length );
+
+#endif
@@ -72,6 +72,12 @@ Modbus::Modbus(uint8_t u8id, Stream& port, uint8_t u8txenpin)
     this->u8txenpin = u8txenpin;
     this->u16timeOut = 1000;
     this->u32overTime = 0;
+    this->bRxTimer = false;
+    this->u8firstWritable = 0;
+    this->writeCheck = NULL;
+    this->pWriteCheckContext = NULL;
+    this->u16T15us = (T35 * 1000UL) * 3 / 7;
+    this->u16T35us = T35 * 1000UL;
 }
 
 
@@ -94,6 +100,12 @@ Modbus::Modbus(uint8_t u8id, uint8_t u8serno, uint8_t u8txenpin)
     this->u8txenpin = u8txenpin;
     this->u16timeOut = 1000;
     this->u32overTime = 0;
+    this->bRxTimer = false;
+    this->u8firstWritable = 0;
+    this->writeCheck = NULL;
+    this->pWriteCheckContext = NULL;
+    this->u16T15us = (T35 * 1000UL) * 3 / 7;
+    this->u16T35us = T35 * 1000UL;
 
     switch( u8serno )
     {
@@ -145,6 +157,9 @@ void Modbus::start()
     while(port->read() >= 0);
     u8lastRec = u8BufferSize = 0;
     u16InCnt = u16OutCnt = u16errCnt = 0;
+    u8silentTicks = u8lastRecTimer = 0;
+    bFrameReady = bFrameBroken = false;
+    resetStats();
 }
 
 
@@ -164,6 +179,7 @@ void Modbus::begin(T_Stream* install_port, long u32speed)
 {
     port = install_port;
     install_port->begin(u32speed);
+    setBaudRate(u32speed);
     start();
 }
 
@@ -186,6 +202,7 @@ void Modbus::begin(T_Stream* install_port, long u32speed, uint8_t u8txenpin)
     this->u8txenpin = u8txenpin;
     this->port = install_port;
     install_port->begin(u32speed);
+    setBaudRate(u32speed);
     start();
 }
 
@@ -205,6 +222,7 @@ void Modbus::begin(long u32speed)
 {
     // !!Can ONLY do this if port ACTUALLY IS a HardwareSerial object!!
     static_cast<HardwareSerial*>(port)->begin(u32speed);
+    setBaudRate(u32speed);
     start();
 }
 
@@ -239,6 +257,171 @@ void Modbus::setTxendPinOverTime( uint32_t u32overTime )
     this->u32overTime = u32overTime;
 }
 
+/**
+ * @brief
+ * Set the inter-character (T1.5) and inter-frame (T3.5) silence for the
+ * baud rate the port has been started with.
+ *
+ * Up to 19200 baud they are 1.5 and 3.5 character times, above it the
+ * Modbus over serial line spec fixes them at 750 us and 1750 us.
+ * Without this call T3.5 is T35 milliseconds.
+ *
+ * @param u32baud baud rate given to the port's begin()
+ * @ingroup setup
+ */
+void Modbus::setBaudRate( uint32_t u32baud )
+{
+    if (u32baud > 19200)
+    {
+        u16T15us = T15_FAST_US;
+        u16T35us = T35_FAST_US;
+    }
+    else
+    {
+        uint32_t u32charUs = (CHAR_BITS * 1000000UL + u32baud - 1) / u32baud;
+        u16T15us = u32charUs * 3 / 2;
+        u16T35us = u32charUs * 7 / 2;
+    }
+
+    if (bRxTimer) updateRxTicks();
+}
+
+/**
+ * @return T1.5 in microseconds
+ * @ingroup setup
+ */
+uint16_t Modbus::getT15()
+{
+    return u16T15us;
+}
+
+/**
+ * @return T3.5 in microseconds
+ * @ingroup setup
+ */
+uint16_t Modbus::getT35()
+{
+    return u16T35us;
+}
+
+/**
+ * @brief
+ * Only for slave: registers below u8first are read only.
+ * A write (FC5, FC6, FC15, FC16) starting there is answered with
+ * ILLEGAL DATA ADDRESS and doesn't change anything. 0 by default,
+ * all the registers are writable.
+ *
+ * @param u8first first register the master may write
+ * @ingroup setup
+ */
+void Modbus::setFirstWritable( uint8_t u8first )
+{
+    u8firstWritable = u8first;
+}
+
+/**
+ * @brief
+ * Only for slave: the values of every register write (FC6, FC16) are
+ * passed to check before anything is written. If it returns false the
+ * write is answered with ILLEGAL DATA VALUE and doesn't change anything.
+ * NULL by default, any value is accepted.
+ *
+ * @param check called from poll() with the start, count and values of the write
+ * @param pContext passed to check as is
+ * @ingroup setup
+ */
+void Modbus::setWriteCheck( write_check_t check, void *pContext )
+{
+    writeCheck = check;
+    pWriteCheckContext = pContext;
+}
+
+/**
+ * @brief
+ * Switch frame end detection to a hardware timer.
+ *
+ * By default poll() looks for T35 of silence with millis(), so a frame is
+ * only noticed if poll() happens to be called often enough.
+ * With the timer, rxTimerTick() must be called from a timer interrupt every
+ * u16tickUs microseconds. It restarts the silence count on every received
+ * byte and marks the frame as complete after T3.5, then poll() takes the
+ * frame at once. A frame with a gap between T1.5 and T3.5 inside is
+ * dropped with ERR_POLLING. The millis() path doesn't check T1.5.
+ *
+ * @param u16tickUs period of the timer interrupt, must be shorter than T1.5
+ * @ingroup setup
+ */
+void Modbus::enableRxTimer( uint16_t u16tickUs )
+{
+    this->u16tickUs = u16tickUs;
+    updateRxTicks();
+    u8silentTicks = u8lastRecTimer = 0;
+    bFrameReady = bFrameBroken = false;
+    bRxTimer = true;
+}
+
+/**
+ * @brief
+ * Converts T1.5 and T3.5 to timer ticks.
+ * The silence is counted from the tick that has seen the last byte, so
+ * n ticks of silence mean somewhere between n-1 and n tick periods.
+ * T1.5 gets one tick more to be sure it has really passed.
+ *
+ * @ingroup setup
+ */
+void Modbus::updateRxTicks()
+{
+    uint16_t u16ticks15 = (u16T15us + u16tickUs - 1) / u16tickUs + 1;
+    uint16_t u16ticks35 = (u16T35us + u16tickUs - 1) / u16tickUs;
+    if (u16ticks35 < u16ticks15 + 1) u16ticks35 = u16ticks15 + 1;
+
+    u8ticksT15 = (u16ticks15 > 254) ? 254 : u16ticks15;
+    u8ticksT35 = (u16ticks35 > 255) ? 255 : u16ticks35;
+}
+
+/**
+ * @brief
+ * Frame end detection step, see enableRxTimer().
+ * Safe to call from an interrupt, it only reads the number of received bytes.
+ *
+ * A byte after T1.5 but before T3.5 of silence breaks the frame (RTU
+ * spec 2.5.1.1). A byte after T3.5 starts the next frame, it must not
+ * break the one that is complete and waits for poll().
+ *
+ * @return true once per frame, when T35 of silence after it has elapsed
+ * @ingroup loop
+ */
+boolean Modbus::rxTimerTick()
+{
+    uint8_t u8current = port->available();
+
+    if (u8current == 0)
+    {
+        u8lastRecTimer = 0;
+        bFrameBroken = false;
+        return false;
+    }
+
+    // a new byte has come, restart the inter-character timer
+    if (u8current != u8lastRecTimer)
+    {
+        // the byte belongs to a frame that had a gap between T1.5 and T3.5
+        if (u8lastRecTimer != 0 && !bFrameReady &&
+            u8silentTicks >= u8ticksT15 && u8silentTicks < u8ticksT35) bFrameBroken = true;
+
+        u8lastRecTimer = u8current;
+        u8silentTicks = 0;
+        return false;
+    }
+
+    if (bFrameReady || u8silentTicks >= u8ticksT35) return false;
+
+    if (++u8silentTicks < u8ticksT35) return false;
+
+    bFrameReady = true;
+    return true;
+}
+
 /**
  * @brief
  * Method to read current slave ID address
@@ -319,6 +502,31 @@ uint16_t Modbus::getErrCnt()
     return u16errCnt;
 }
 
+/**
+ * @brief
+ * Get bus statistics of the master
+ * This can be useful to see the bus load and the slave response time
+ *
+ * @return statistics since start() or resetStats()
+ * @ingroup buffer
+ */
+const modbus_stats_t &Modbus::getStats()
+{
+    return stats;
+}
+
+/**
+ * @brief
+ * Clear bus statistics and start measuring the duty cycle from now
+ *
+ * @ingroup buffer
+ */
+void Modbus::resetStats()
+{
+    memset(&stats, 0, sizeof(stats));
+    stats.u32startMs = millis();
+}
+
 /**
  * Get modbus master state
  *
@@ -344,6 +552,57 @@ uint8_t Modbus::getLastError()
     return u8lastError;
 }
 
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Send a complete query frame, CRC included, stored in flash (PROGMEM).
+ * For queries that never change: the frame is built once at compile time,
+ * so nothing is encoded and no CRC is calculated here.
+ * Only writes (FC 5, 6, 15, 16) are accepted, there are no registers
+ * to put the reply of a read into.
+ * A frame for slave 0 is a broadcast: the slaves don't reply, so the master
+ * stays in COM_IDLE. The caller has to give the slaves the turnaround delay
+ * before the next query.
+ *
+ * @param au8frame  PROGMEM pointer to the frame
+ * @param u8size    frame length with the CRC
+ * @return 0 if sent, -1 busy, -2 not a master, -3 not a valid write frame
+ * @ingroup loop
+ */
+int8_t Modbus::queryFrame_P( const uint8_t *au8frame, uint8_t u8size )
+{
+    if (u8id!=0) return -2;
+    if (u8state != COM_IDLE) return -1;
+
+    if (u8size < 8 || u8size > MAX_BUFFER) return -3;
+
+    memcpy_P( au8Buffer, au8frame, u8size );
+
+    switch( au8Buffer[ FUNC ] )
+    {
+    case MB_FC_WRITE_COIL:
+    case MB_FC_WRITE_REGISTER:
+    case MB_FC_WRITE_MULTIPLE_COILS:
+    case MB_FC_WRITE_MULTIPLE_REGISTERS:
+        break;
+    default:
+        return -3;
+    }
+
+    au16regs = NULL;
+    u8BufferSize = u8size;
+    for (uint8_t i = 0; i < BYTE_CNT; i++) au8Query[ i ] = au8Buffer[ i ];
+
+    u32queryUs = micros();
+    transmitTxBuffer();
+    u8lastError = 0;
+
+    if (au8Buffer[ ID ] == 0) return 0;
+
+    u8state = COM_WAITING;
+    return 0;
+}
+
 /**
  * @brief
  * *** Only Modbus Master ***
@@ -436,6 +695,8 @@ int8_t Modbus::query( modbus_t telegram )
         break;
     }
 
+    for (uint8_t i = 0; i < BYTE_CNT; i++) au8Query[ i ] = au8Buffer[ i ];
+
     sendTxBuffer();
     u8state = COM_WAITING;
     u8lastError = 0;
@@ -452,12 +713,19 @@ int8_t Modbus::query( modbus_t telegram )
  * Any incoming data would be redirected to au16regs pointer,
  * as defined in its modbus_t query telegram.
  *
+ * When the master goes back to COM_IDLE, getLastError() tells how the
+ * transaction has ended: 0 if OK, NO_REPLY, ERR_POLLING, ERR_BUFF_OVERFLOW,
+ * ERR_BAD_CRC, ERR_EXCEPTION or EXC_FUNC_CODE otherwise.
+ *
  * @params	nothing
  * @return errors counter
  * @ingroup loop
  */
 int8_t Modbus::poll()
 {
+    // nothing is expected
+    if (u8state == COM_IDLE) return 0;
+
     // check if there is any incoming frame
 	uint8_t u8current;
     u8current = port->available();
@@ -467,35 +735,52 @@ int8_t Modbus::poll()
         u8state = COM_IDLE;
         u8lastError = NO_REPLY;
         u16errCnt++;
+        updateStats();
         return 0;
     }
 
     if (u8current == 0) return 0;
 
-    // check T35 after frame end or still no frame end
-    if (u8current != u8lastRec)
+    if (bRxTimer)
     {
-        u8lastRec = u8current;
-        u32time = millis();
-        return 0;
+        // the timer has not seen T35 after the last byte yet
+        if (!bFrameReady) return 0;
+        bFrameReady = false;
+    }
+    else
+    {
+        // check T35 after frame end or still no frame end
+        if (u8current != u8lastRec)
+        {
+            u8lastRec = u8current;
+            u32time = micros();
+            return 0;
+        }
+        if ((unsigned long)(micros() -u32time) < (unsigned long)u16T35us) return 0;
     }
-    if ((unsigned long)(millis() -u32time) < (unsigned long)T35) return 0;
 
     // transfer Serial buffer frame to auBuffer
     u8lastRec = 0;
     int8_t i8state = getRxBuffer();
-    if (i8state < 6) //7 was incorrect for functions 1 and 2 the smallest frame could be 6 bytes long
+    if (bRxTimer && bFrameBroken) i8state = ERR_POLLING;
+    bFrameBroken = false;
+    if (i8state < 5) //7 was incorrect for functions 1 and 2 the smallest frame could be 6 bytes long, an exception is 5
     {
         u8state = COM_IDLE;
+        u8lastError = (i8state == ERR_BUFF_OVERFLOW) ? ERR_BUFF_OVERFLOW : ERR_POLLING;
         u16errCnt++;
+        updateStats();
         return i8state;
     }
 
     // validate message: id, CRC, FCT, exception
     uint8_t u8exception = validateAnswer();
+    if (u8exception == 0) u8exception = validateReply();
     if (u8exception != 0)
     {
         u8state = COM_IDLE;
+        u8lastError = u8exception;
+        updateStats();
         return u8exception;
     }
 
@@ -522,6 +807,7 @@ int8_t Modbus::poll()
         break;
     }
     u8state = COM_IDLE;
+    updateStats();
     return u8BufferSize;
 }
 
@@ -555,10 +841,10 @@ int8_t Modbus::poll( uint16_t *regs, uint8_t u8size )
     if (u8current != u8lastRec)
     {
         u8lastRec = u8current;
-        u32time = millis();
+        u32time = micros();
         return 0;
     }
-    if ((unsigned long)(millis() -u32time) < (unsigned long)T35) return 0;
+    if ((unsigned long)(micros() -u32time) < (unsigned long)u16T35us) return 0;
 
     u8lastRec = 0;
     int8_t i8state = getRxBuffer();
@@ -660,6 +946,8 @@ int8_t Modbus::getRxBuffer()
  */
 void Modbus::sendTxBuffer()
 {
+    u32queryUs = micros();
+
     // append CRC to message
     uint16_t u16crc = calcCRC( u8BufferSize );
     au8Buffer[ u8BufferSize ] = u16crc >> 8;
@@ -667,6 +955,17 @@ void Modbus::sendTxBuffer()
     au8Buffer[ u8BufferSize ] = u16crc & 0x00ff;
     u8BufferSize++;
 
+    transmitTxBuffer();
+}
+
+/**
+ * @brief
+ * This method transmits au8Buffer, which already ends with the CRC.
+ *
+ * @ingroup buffer
+ */
+void Modbus::transmitTxBuffer()
+{
     if (u8txenpin > 1)
     {
         // set RS485 transceiver to transmit mode
@@ -689,6 +988,7 @@ void Modbus::sendTxBuffer()
         digitalWrite( u8txenpin, LOW );
     }
     while(port->read() >= 0);
+    bFrameReady = bFrameBroken = false;
 
     u8BufferSize = 0;
 
@@ -708,26 +1008,10 @@ void Modbus::sendTxBuffer()
  */
 uint16_t Modbus::calcCRC(uint8_t u8length)
 {
-    unsigned int temp, temp2, flag;
-    temp = 0xFFFF;
-    for (unsigned char i = 0; i < u8length; i++)
-    {
-        temp = temp ^ au8Buffer[i];
-        for (unsigned char j = 1; j <= 8; j++)
-        {
-            flag = temp & 0x0001;
-            temp >>=1;
-            if (flag)
-                temp ^= 0xA001;
-        }
-    }
-    // Reverse byte order.
-    temp2 = temp >> 8;
-    temp = (temp << 8) | temp2;
-    temp &= 0xFFFF;
+    uint16_t temp = crc16( au8Buffer, u8length );
     // the returned value is already swapped
     // crcLo byte is first & crcHi byte is last
-    return temp;
+    return (temp << 8) | (temp >> 8);
 }
 
 /**
@@ -766,37 +1050,70 @@ uint8_t Modbus::validateRequest()
     }
 
     // check start address & nb range
-    uint16_t u16regs = 0;
-    uint8_t u8regs;
+    // in 16 bit, a cast to 8 bit let e.g. register 256 pass as register 0
+    uint16_t u16start = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ]);
+    uint16_t u16count = word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ]);
+    uint16_t u16coils = (uint16_t) u8regsize * 16;
     switch ( au8Buffer[ FUNC ] )
     {
     case MB_FC_READ_COILS:
     case MB_FC_READ_DISCRETE_INPUT:
     case MB_FC_WRITE_MULTIPLE_COILS:
-        u16regs = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ]) / 16;
-        u16regs += word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ]) /16;
-        u8regs = (uint8_t) u16regs;
-        if (u8regs > u8regsize) return EXC_ADDR_RANGE;
+        // the range ends at start + count exclusive, it may end at the size
+        if (u16count == 0) return EXC_REGS_QUANT;
+        if (u16start >= u16coils || u16count > u16coils - u16start) return EXC_ADDR_RANGE;
         break;
     case MB_FC_WRITE_COIL:
-        u16regs = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ]) / 16;
-        u8regs = (uint8_t) u16regs;
-        if (u8regs > u8regsize) return EXC_ADDR_RANGE;
+        if (u16start >= u16coils) return EXC_ADDR_RANGE;
         break;
     case MB_FC_WRITE_REGISTER :
-        u16regs = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ]);
-        u8regs = (uint8_t) u16regs;
-        if (u8regs > u8regsize) return EXC_ADDR_RANGE;
+        if (u16start >= u8regsize) return EXC_ADDR_RANGE;
         break;
     case MB_FC_READ_REGISTERS :
     case MB_FC_READ_INPUT_REGISTER :
     case MB_FC_WRITE_MULTIPLE_REGISTERS :
-        u16regs = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ]);
-        u16regs += word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ]);
-        u8regs = (uint8_t) u16regs;
-        if (u8regs > u8regsize) return EXC_ADDR_RANGE;
+        if (u16count == 0) return EXC_REGS_QUANT;
+        if (u16start >= u8regsize || u16count > u8regsize - u16start) return EXC_ADDR_RANGE;
+        break;
+    }
+
+    // writes into the read only registers, see setFirstWritable()
+    switch ( au8Buffer[ FUNC ] )
+    {
+    case MB_FC_WRITE_COIL:
+    case MB_FC_WRITE_MULTIPLE_COILS:
+        if (u16start / 16 < u8firstWritable) return EXC_ADDR_RANGE;
+        break;
+    case MB_FC_WRITE_REGISTER :
+    case MB_FC_WRITE_MULTIPLE_REGISTERS :
+        if (u16start < u8firstWritable) return EXC_ADDR_RANGE;
         break;
     }
+
+    // values refused by the application, see setWriteCheck()
+    if (writeCheck != NULL)
+    {
+        uint16_t au16values[ (MAX_BUFFER - BYTE_CNT - 1 - CHECKSUM_SIZE) / 2 ];
+
+        switch ( au8Buffer[ FUNC ] )
+        {
+        case MB_FC_WRITE_REGISTER :
+            // the value is where the count of the other functions is
+            au16values[ 0 ] = u16count;
+            if (!writeCheck( u16start, 1, au16values, pWriteCheckContext )) return EXC_DATA_VALUE;
+            break;
+        case MB_FC_WRITE_MULTIPLE_REGISTERS :
+            if (BYTE_CNT + 1 + u16count * 2 + CHECKSUM_SIZE > u8BufferSize) return EXC_REGS_QUANT;
+            for (uint8_t i = 0; i < u16count; i++)
+            {
+                au16values[ i ] = word(
+                                      au8Buffer[ (BYTE_CNT + 1) + i * 2 ],
+                                      au8Buffer[ (BYTE_CNT + 2) + i * 2 ]);
+            }
+            if (!writeCheck( u16start, u16count, au16values, pWriteCheckContext )) return EXC_DATA_VALUE;
+            break;
+        }
+    }
     return 0; // OK, no exception code thrown
 }
 
@@ -816,7 +1133,7 @@ uint8_t Modbus::validateAnswer()
     if ( calcCRC( u8BufferSize-2 ) != u16MsgCRC )
     {
         u16errCnt ++;
-        return NO_REPLY;
+        return ERR_BAD_CRC;
     }
 
     // check exception
@@ -845,6 +1162,108 @@ uint8_t Modbus::validateAnswer()
     return 0; // OK, no exception code thrown
 }
 
+/**
+ * @brief
+ * This method checks that a valid master incoming message is the reply
+ * to the last query: the same slave and function, the echo of a write,
+ * the byte count of a read. Nothing is copied to au16regs otherwise.
+ *
+ * @return 0 if OK, ERR_BAD_REPLY if the message belongs to another query
+ * @ingroup buffer
+ */
+uint8_t Modbus::validateReply()
+{
+    uint16_t u16quantity = word( au8Query[ NB_HI ], au8Query[ NB_LO ] );
+    uint8_t u8bytes = 0;
+    boolean isValid = (au8Buffer[ ID ] == au8Query[ ID ]) && (au8Buffer[ FUNC ] == au8Query[ FUNC ]);
+
+    switch( au8Query[ FUNC ] )
+    {
+    case MB_FC_READ_COILS:
+    case MB_FC_READ_DISCRETE_INPUT:
+        u8bytes = (u16quantity + 7) / 8;
+        isValid = isValid && au8Buffer[ 2 ] == u8bytes && u8BufferSize == u8bytes + 5;
+        break;
+    case MB_FC_READ_INPUT_REGISTER:
+    case MB_FC_READ_REGISTERS :
+        u8bytes = u16quantity * 2;
+        isValid = isValid && au8Buffer[ 2 ] == u8bytes && u8BufferSize == u8bytes + 5;
+        break;
+    case MB_FC_WRITE_COIL:
+    case MB_FC_WRITE_REGISTER :
+    case MB_FC_WRITE_MULTIPLE_COILS:
+    case MB_FC_WRITE_MULTIPLE_REGISTERS :
+        // the slave echoes the address and the value or the quantity
+        isValid = isValid && u8BufferSize == 8;
+        for (uint8_t i = ADD_HI; isValid && i < BYTE_CNT; i++)
+        {
+            isValid = au8Buffer[ i ] == au8Query[ i ];
+        }
+        break;
+    }
+
+    if (!isValid)
+    {
+        u16errCnt ++;
+        return ERR_BAD_REPLY;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief
+ * Accounts the query that has just been finished with u8lastError:
+ * round trip into the histogram of its function code, busy time and
+ * error counters. Called only by the master.
+ *
+ * @ingroup buffer
+ */
+void Modbus::updateStats()
+{
+    uint32_t u32latency = micros() - u32queryUs;
+
+    uint32_t u32busy = stats.u16busyUs + u32latency;
+    stats.u32busyMs += u32busy / 1000;
+    stats.u16busyUs = u32busy % 1000;
+
+    switch ((int8_t)u8lastError)
+    {
+    case 0:
+        break;
+    case (int8_t)NO_REPLY:
+        stats.u16timeouts++;
+        return;
+    case ERR_BAD_CRC:
+        stats.u16crcErrors++;
+        return;
+    case ERR_EXCEPTION:
+        stats.u16exceptions++;
+        break;
+    default:
+        stats.u16badFrames++;
+        return;
+    }
+
+    // only the replies that have been parsed go into the histogram
+    uint8_t u8bucket = 0;
+    u32latency >>= LATENCY_MIN_LOG2;
+    while (u32latency != 0 && u8bucket < LATENCY_BUCKETS - 1)
+    {
+        u32latency >>= 1;
+        u8bucket++;
+    }
+
+    for (uint8_t i = 0; i < sizeof(fctsupported); i++)
+    {
+        if (fctsupported[i] == au8Query[ FUNC ])
+        {
+            if (stats.au16latency[i][u8bucket] < 0xFFFF) stats.au16latency[i][u8bucket]++;
+            break;
+        }
+    }
+}
+
 /**
  * @brief
  * This method builds an exception message
@@ -43,6 +43,7 @@
 
 #include <inttypes.h>
 #include "Arduino.h"
+#include "ModbusCrc.h"
 
 
 /**
@@ -121,7 +122,8 @@ enum ERR_LIST
     ERR_POLLING                   = -2,
     ERR_BUFF_OVERFLOW             = -3,
     ERR_BAD_CRC                   = -4,
-    ERR_EXCEPTION                 = -5
+    ERR_EXCEPTION                 = -5,
+    ERR_BAD_REPLY                 = -6 //!< the reply doesn't match the query
 };
 
 enum
@@ -130,6 +132,7 @@ enum
     EXC_FUNC_CODE = 1,
     EXC_ADDR_RANGE = 2,
     EXC_REGS_QUANT = 3,
+    EXC_DATA_VALUE = 3, //!< ILLEGAL DATA VALUE, the same code as EXC_REGS_QUANT
     EXC_EXECUTE = 4
 };
 
@@ -145,9 +148,41 @@ const unsigned char fctsupported[] =
     MB_FC_WRITE_MULTIPLE_REGISTERS
 };
 
-#define T35  5
+#define LATENCY_BUCKETS  12 //!< round trip histogram: <512 us, then one bucket per power of two
+#define LATENCY_MIN_LOG2  9 //!< the first bucket ends at 2^9 us
+
+/**
+ * @struct modbus_stats_t
+ * @brief
+ * Master bus statistics since the last resetStats().
+ * Round trip is from sending the query to the end of the reply,
+ * au16latency[i] counts the replies of function code fctsupported[i].
+ */
+typedef struct
+{
+    uint16_t au16latency[sizeof(fctsupported)][LATENCY_BUCKETS]; /*!< bucket b >= 1: [2^(8+b), 2^(9+b)) us */
+    uint16_t u16timeouts;   /*!< no reply */
+    uint16_t u16crcErrors;  /*!< ERR_BAD_CRC */
+    uint16_t u16exceptions; /*!< ERR_EXCEPTION */
+    uint16_t u16badFrames;  /*!< ERR_POLLING, ERR_BUFF_OVERFLOW, ERR_BAD_REPLY, unsupported function */
+    uint32_t u32busyMs;     /*!< time spent waiting for replies, duty cycle = u32busyMs / elapsed */
+    uint16_t u16busyUs;     /*!< the rest of the busy time below 1 ms */
+    uint32_t u32startMs;    /*!< millis() of the last reset */
+}
+modbus_stats_t;
+
+#define T35  5 //!< default T3.5 in ms, until setBaudRate() is called
+#define CHAR_BITS  11 //!< RTU character: start, 8 data, parity or 2nd stop, stop
+#define T15_FAST_US  750  //!< fixed T1.5 above 19200 baud
+#define T35_FAST_US  1750 //!< fixed T3.5 above 19200 baud
 #define  MAX_BUFFER  64	//!< maximum size for the communication buffer in bytes
 
+/**
+ * Slave write check: u16count registers from u16start are about to be set
+ * to au16values. Returns false to refuse the whole write, see setWriteCheck().
+ */
+typedef boolean (*write_check_t)( uint16_t u16start, uint16_t u16count, const uint16_t *au16values, void *pContext );
+
 /**
  * @class Modbus
  * @brief
@@ -163,6 +198,9 @@ private:
     uint8_t u8state;
     uint8_t u8lastError;
     uint8_t au8Buffer[MAX_BUFFER];
+    uint8_t au8Query[BYTE_CNT]; //!< header of the last query, to match the reply with
+    uint32_t u32queryUs; //!< micros() when the last query was sent
+    modbus_stats_t stats;
     uint8_t u8BufferSize;
     uint8_t u8lastRec;
     uint16_t *au16regs;
@@ -170,11 +208,28 @@ private:
     uint16_t u16timeOut;
     uint32_t u32time, u32timeOut, u32overTime;
     uint8_t u8regsize;
+    uint8_t u8firstWritable; //!< slave: registers below it are read only
+    write_check_t writeCheck; //!< slave: checks the values of FC6/FC16, NULL - none
+    void *pWriteCheckContext;
+    uint16_t u16T15us, u16T35us; //!< inter-character and inter-frame silence
+
+    // frame end detection from a timer interrupt, see enableRxTimer()
+    boolean bRxTimer;
+    uint16_t u16tickUs;
+    uint8_t u8ticksT15, u8ticksT35;
+    volatile uint8_t u8silentTicks;
+    volatile uint8_t u8lastRecTimer;
+    volatile boolean bFrameReady;
+    volatile boolean bFrameBroken;
 
+    void updateRxTicks();
     void sendTxBuffer();
+    void transmitTxBuffer();
     int8_t getRxBuffer();
     uint16_t calcCRC(uint8_t u8length);
     uint8_t validateAnswer();
+    uint8_t validateReply();
+    void updateStats();
     uint8_t validateRequest();
     void get_FC1();
     void get_FC3();
@@ -194,6 +249,7 @@ public:
     uint16_t getTimeOut(); //!<get communication watch-dog timer value
     boolean getTimeOutState(); //!<get communication watch-dog timer state
     int8_t query( modbus_t telegram ); //!<only for master
+    int8_t queryFrame_P( const uint8_t *au8frame, uint8_t u8size ); //!<only for master, prebuilt write frame in flash
     int8_t poll(); //!<cyclic poll for master
     int8_t poll( uint16_t *regs, uint8_t u8size ); //!<cyclic poll for slave
     uint16_t getInCnt(); //!<number of incoming messages
@@ -204,6 +260,15 @@ public:
     uint8_t getLastError(); //!<get last error message
     void setID( uint8_t u8id ); //!<write new ID for the slave
     void setTxendPinOverTime( uint32_t u32overTime );
+    void setBaudRate( uint32_t u32baud ); //!<derive T1.5 and T3.5 from the baud rate of the port
+    uint16_t getT15(); //!<T1.5 in microseconds
+    uint16_t getT35(); //!<T3.5 in microseconds
+    void setFirstWritable( uint8_t u8first ); //!<only for slave, writes below u8first get ILLEGAL DATA ADDRESS
+    void setWriteCheck( write_check_t check, void *pContext ); //!<only for slave, refused writes get ILLEGAL DATA VALUE
+    const modbus_stats_t &getStats(); //!<round trip histograms, error counters and busy time
+    void resetStats();
+    void enableRxTimer( uint16_t u16tickUs ); //!<detect frame end with rxTimerTick() instead of millis()
+    boolean rxTimerTick(); //!<call from a timer ISR every u16tickUs, true if a frame has just ended
     void end(); //!<finish any communication and release serial communication port
 
     //
@@ -0,0 +1,83 @@
+/**
+ *  CRC benchmark:
+ *  Measures the CPU cycles per byte of every CRC16 variant
+ *  (bitwise, nibble table, byte table) and checks that they agree.
+ *  The result is printed to Serial at 115200 baud.
+ *
+ *  On AVR the cycles are counted with Timer1 running at F_CPU,
+ *  on other boards they are estimated from micros().
+ *  The host figures come from the native test: pio test -e native -f native/test_modbus_crc
+ */
+
+#include <ModbusRtu.h>
+
+const uint8_t FRAME_SIZE = MAX_BUFFER;
+const uint8_t REPEATS = 16;
+
+uint8_t au8frame[ FRAME_SIZE ];
+
+// every result is stored here, so the compiler can't drop a CRC call as unused
+volatile uint16_t u16sink;
+
+typedef uint16_t (*crc_function)( const uint8_t *, uint16_t );
+
+uint32_t measureCycles( crc_function crc )
+{
+  uint32_t u32total = 0;
+
+  for (uint8_t i = 0; i < REPEATS; i++)
+  {
+#if defined(__AVR__)
+    noInterrupts();
+    TCCR1A = 0;
+    TCCR1B = _BV( CS10 ); // no prescaler, one count per CPU cycle
+    TCNT1 = 0;
+    u16sink = crc( au8frame, FRAME_SIZE );
+    uint16_t u16cycles = TCNT1;
+    interrupts();
+    u32total += u16cycles;
+#else
+    uint32_t u32start = micros();
+    u16sink = crc( au8frame, FRAME_SIZE );
+    u32total += (micros() - u32start) * (F_CPU / 1000000UL);
+#endif
+  }
+
+  return u32total / REPEATS;
+}
+
+void report( const char *name, crc_function crc )
+{
+  uint32_t u32cycles = measureCycles( crc );
+
+  Serial.print( name );
+  Serial.print( ": " );
+  Serial.print( u32cycles );
+  Serial.print( " cycles per frame, " );
+  Serial.print( (float) u32cycles / FRAME_SIZE );
+  Serial.println( " cycles per byte" );
+}
+
+void setup() {
+  Serial.begin( 115200 );
+
+  randomSeed( 1 );
+  for (uint8_t i = 0; i < FRAME_SIZE; i++) au8frame[ i ] = random( 256 );
+
+  uint16_t u16reference = crc16Bitwise( au8frame, FRAME_SIZE );
+  if (crc16Nibble( au8frame, FRAME_SIZE ) != u16reference ||
+      crc16Table( au8frame, FRAME_SIZE ) != u16reference)
+  {
+    Serial.println( "CRC variants disagree!" );
+    return;
+  }
+
+  Serial.print( FRAME_SIZE );
+  Serial.println( " byte frame" );
+  report( "bitwise", crc16Bitwise );
+  report( "nibble table", crc16Nibble );
+  report( "byte table", crc16Table );
+}
+
+void loop() {
+}
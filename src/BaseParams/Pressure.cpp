@@ -1,56 +1,56 @@
 #include "BaseParams/Pressure.h"
 
 Pressure::Pressure() 
-    : target_value(29)
-    , low_limit(target_value - 1)
-    , optimal_high_limit(target_value + 1)
-    , high_limit(target_value + 10)
+    : target_value(pressure_from_int(29))
+    , low_limit(target_value - pressure_from_int(1))
+    , optimal_high_limit(target_value + pressure_from_int(1))
+    , high_limit(target_value + pressure_from_int(10))
     , tare_value(0)
-    , current_value(1)
+    , current_value(pressure_from_int(1))
 {
 }
 
-void Pressure::set_tare(const float &tare)
+void Pressure::set_tare(const pressure_t &tare)
 {
     tare_value = tare;
 }
 
-const float &Pressure::get_tare()
+const pressure_t &Pressure::get_tare()
 {
     return tare_value;
 }
 
-void Pressure::set_target(const float &target)
+void Pressure::set_target(const pressure_t &target)
 {
     target_value = target;
-    low_limit = target - 1;
-    optimal_high_limit = target + 1;
-	high_limit = target + 10;
+    low_limit = target - pressure_from_int(1);
+    optimal_high_limit = target + pressure_from_int(1);
+	high_limit = target + pressure_from_int(10);
 }
 
-const float &Pressure::get_target()
+const pressure_t &Pressure::get_target()
 {
     return target_value;
 }
 
-void Pressure::set_value(const float &value)
+void Pressure::set_value(const pressure_t &value)
 {
     current_value = value;
 }
 
-const float &Pressure::get_value()
+const pressure_t &Pressure::get_value()
 {
     return current_value;
 }
 
-const float& Pressure::get_low_limit() {
+const pressure_t& Pressure::get_low_limit() {
     return low_limit;
 }
 
-const float& Pressure::get_optimal_high_limit() {
+const pressure_t& Pressure::get_optimal_high_limit() {
     return optimal_high_limit;
 }
 
-const float& Pressure::get_high_limit() {
+const pressure_t& Pressure::get_high_limit() {
     return high_limit;
 }
@@ -8,8 +8,16 @@
 #include "bubble_remover.h"
 #include "CLI.h"
 #include "BaseParams/Pressure.h"
+#include "sample_ring.h"
+#include "double_buffer.h"
+#include "burst_capture.h"
+#include "trimmed_mean_filter.h"
+#include "exponential_smoother.h"
+#include "pid_controller.h"
+#include "periodic_executor.h"
+#include "scada_slave.h"
+#include "telemetry.h"
 
-#include "GyverPID.h"
 #include "GyverTimers.h"
 
 #include <microDS18B20.h>
@@ -34,8 +42,30 @@ void regime_handler(const String& str);
 void emulate_bubble_handler(const String& str);
 void temp_low_limit_handler(const String& str);
 void temp_high_limit_handler(const String& str);
-
-void set_PID(const float &value);
+void filter_handler(const String& str);
+void control_stats_handler(const String& str);
+void modbus_stats_handler(const String& str);
+void telemetry_handler(const String& str);
+void capture_handler(const String& str);
+void telemetry_decimate(const String& str);
+void telemetry_compact(const String& str);
+void print_telemetry_bandwidth();
+
+Pump &selected_pump();
+void set_PID(const pressure_t &value);
+void set_target_pressure(const pressure_t &target);
+uint8_t pack_alerts();
+void publish_scada_snapshot();
+void publish_telemetry_snapshot();
+void pack_status_payload(const TelemetrySnapshot &snapshot, const Time &frame_time, uint8_t *payload);
+uint8_t pack_modbus_stats_payload(uint8_t *payload);
+void send_telemetry(const uint8_t *frame, const uint8_t &size);
+bool is_telemetry_streaming();
+void send_stream_frames(const TelemetrySnapshot &snapshot);
+void send_compact_frame();
+void send_capture_frames();
+void quantize_stream_fields(const TelemetryPressurePoint &point, const TelemetrySnapshot &snapshot, int32_t *values);
+void apply_scada_setpoints(const uint8_t &changed_mask);
 void check_button(const uint8_t &button_number);
 
 void regime1_handler(const uint8_t &binState);
@@ -46,8 +76,69 @@ void kidney_handler(const uint8_t &binState);
 
 const uint32_t PRESSURE_SENSOR_TICK_RATE = 100;
 
-GyverPID pid(0.2, 0.2, 0.2, PRESSURE_SENSOR_TICK_RATE);
-Pump pump;
+/** Pressure control cycle: filter output, PID and pump commands */
+const TickType_t CONTROL_PERIOD_TICKS = 2;
+PeriodicExecutor control_executor(CONTROL_PERIOD_TICKS);
+
+/** ADS1115 conversion rate, every conversion is read in ALERT/RDY mode */
+const uint16_t ADS_DATA_RATE = RATE_ADS1115_250SPS;
+const uint16_t ADS_SAMPLES_PER_SECOND = 250;
+
+/** Time between two samples that reach the pressure filter */
+#if PRESSURE_SENSOR_USE_ALERT_RDY
+const uint32_t PRESSURE_SAMPLE_PERIOD_US = 1000000UL / ADS_SAMPLES_PER_SECOND;
+#else
+const uint32_t PRESSURE_SAMPLE_PERIOD_US = (PRESSURE_SENSOR_TICK_RATE / 16) * portTICK_PERIOD_MS * 1000UL;
+#endif
+
+/**
+ * Постоянная времени сглаживания давления. Раньше коэффициент 0.2
+ * применялся раз в 11 циклов по ~96 мс, это около 4.7 с, её и держим
+ * при любой частоте отсчётов.
+ */
+const uint32_t PRESSURE_SMOOTHING_TIME_MS = 4700;
+
+/** Коэффициент сглаживания на один отсчёт, T / tau с 16-ю дробными битами */
+const uint16_t PRESSURE_SMOOTHING_K = (65536ULL * PRESSURE_SAMPLE_PERIOD_US) / (PRESSURE_SMOOTHING_TIME_MS * 1000UL);
+static_assert(PRESSURE_SMOOTHING_K >= 1, "Pressure smoothing coefficient rounds down to zero");
+
+/** If there was no ALERT/RDY edge for this long, the sensor is offline */
+const TickType_t ADS_ALERT_TIMEOUT_TICKS = 100 / 16;
+
+Adafruit_ADS1115 ads;
+
+/** Raw conversions from task_pressure_acquire to task_pressure_sensor_read */
+SampleRing<PressureSample, 32> pressure_samples;
+
+TaskHandle_t pressure_acquire_task_handle = NULL;
+volatile uint32_t ads_ready_timestamp_us = 0;
+uint16_t ads_missed_conversions = 0;
+
+/** Woken up by the Timer1 ISR as soon as the pump reply is received */
+TaskHandle_t pump_control_task_handle = NULL;
+
+/** Max time between two pump.process() calls if there is no reply */
+const TickType_t PUMP_CONTROL_TICK_RATE = 3;
+
+/** Set by the error timer ISR, the pump task sends the broadcast stop */
+volatile bool is_emergency_stop_requested = false;
+
+/**
+ * Pressure filter settings, changed from the CLI and applied
+ * by task_pressure_sensor_read before the next sample
+ */
+const uint8_t PRESSURE_FILTER_MAX_WINDOW = 32;
+uint8_t pressure_filter_window = 10;
+uint8_t pressure_filter_trim_percent = 20;
+
+TrimmedMeanFilter<pressure_t, int32_t, PRESSURE_FILTER_MAX_WINDOW> pressure_filter(pressure_filter_window,
+																			pressure_filter_trim_percent);
+
+/**
+ * Pressure controller, called once per control cycle.
+ * The output is the pump speed with PRESSURE_FRACTION_BITS fractional bits
+ */
+PidController<int32_t, int32_t, 12> pid(0.2, 0.2, 0.2, CONTROL_PERIOD_TICKS * portTICK_PERIOD_MS);
 
 Pressure pressure;
 
@@ -77,6 +168,33 @@ struct PeripheralStatus {
 PeripheralStatus peripheral_status;
 
 KidneyState kidney_selector = KidneyState::LEFT_KIDNEY;
+
+/**
+ * The pump of the selected kidney. The pump of the other kidney is
+ * stopped when it is deselected, nothing controls its pressure.
+ */
+Pump &selected_pump()
+{
+	if (IS_RIGHT_PUMP_INSTALLED && kidney_selector == KidneyState::RIGHT_KIDNEY)
+		return right_pump;
+
+	return left_pump;
+}
+
+/* Every installed pump, a stop has to reach all of them */
+Pump *const installed_pumps[] = {&left_pump, &right_pump};
+const uint8_t INSTALLED_PUMP_COUNT = IS_RIGHT_PUMP_INSTALLED ? 2 : 1;
+
+bool are_pumps_online()
+{
+	for (uint8_t i = 0; i < INSTALLED_PUMP_COUNT; ++i)
+	{
+		if (!installed_pumps[i]->is_online())
+			return false;
+	}
+
+	return true;
+}
 Regime regime_state = Regime::STOPED;
 
 BubbleRemover bubble_remover;
@@ -110,6 +228,9 @@ float TEMP_HIGH_LIMIT = 10;
 
 bool is_system_stabilized = false;
 
+/** Register map for the plant SCADA, see scada_slave.h */
+ScadaSlave scada(Serial2, SCADA_SLAVE_ID);
+
 /**
  * float -> uin32_t -> 4 bytes * 4 -> 16 bytes for all float values
  * uint8_t -> 1 byte * 3 -> 3 bytes for all uint8_t values
@@ -138,6 +259,75 @@ bool is_system_stabilized = false;
 const uint8_t TO_SEND_ARRAY_SIZE = 27;
 uint8_t to_send[TO_SEND_ARRAY_SIZE];
 
+/** The whole frame is put into the UART TX ring at once, without waiting */
+static_assert(TO_SEND_ARRAY_SIZE < SERIAL_TX_BUFFER_SIZE, "Telemetry frame doesn't fit into the UART TX ring");
+static_assert(TELEMETRY_MAX_FRAME_SIZE < SERIAL_TX_BUFFER_SIZE, "Telemetry frame doesn't fit into the UART TX ring");
+static_assert(TO_SEND_ARRAY_SIZE == TELEMETRY_STATUS_PAYLOAD_SIZE + 1, "Legacy frame is the status payload and LF");
+
+/** Legacy by default, the host switches to the framed mode with "telemetry framed" */
+volatile TelemetryMode telemetry_mode = TELEMETRY_MODE_LEGACY;
+TelemetryFramer telemetry_framer;
+uint8_t telemetry_frame[TELEMETRY_MAX_FRAME_SIZE];
+
+/** In the framed mode the pump bus counters go after every N status frames */
+const uint8_t TELEMETRY_MODBUS_STATS_PERIOD = 10;
+
+/**
+ * Values of the telemetry frame, published by the control task every cycle.
+ * The Timer5 ISR only latches the session time and wakes up task_telemetry,
+ * which packs the newest snapshot and sends it.
+ */
+DoubleBuffer<TelemetrySnapshot> telemetry_snapshot;
+Time telemetry_time;
+TaskHandle_t telemetry_task_handle = NULL;
+
+/** Why task_telemetry was woken up, set as notification bits */
+const uint32_t TELEMETRY_NOTIFY_SESSION_TICK = 1UL << 0;	// Timer5, a status frame is due
+const uint32_t TELEMETRY_NOTIFY_STREAM = 1UL << 1;			// the control task has new pressure points
+const uint32_t TELEMETRY_NOTIFY_CAPTURE = 1UL << 2;			// the capture is complete or "capture dump"
+
+/**
+ * Stream frames (framed mode only). The control task puts one pressure
+ * point per slot into the ring, task_telemetry sends the fields due in
+ * that slot. Ratios are set with "telemetry decimate", all off by default.
+ */
+TelemetryStreamClock telemetry_stream_clock;
+TelemetryDecimator telemetry_decimator;
+SampleRing<TelemetryPressurePoint, 16> telemetry_points;
+
+/** Compact stream frames, "telemetry compact <N>" turns them on */
+TelemetryDeltaEncoder telemetry_delta_encoder;
+
+/**
+ * Raw ADS1115 samples around an event, 256 samples are 1 s at 250 SPS.
+ * Armed at start, triggered by "capture trigger", by the trimmed mean
+ * leaving the pressure limits (the control task) or by a new alert, then
+ * frozen until "capture arm". task_telemetry dumps it in the framed mode.
+ *
+ * The control task sees a sample up to a cycle (32 ms) after it, and the
+ * trimmed mean leaves the limits about half a window (20 ms) after the
+ * raw samples do, so the trigger lands some 15 samples after the start
+ * of a spike. The default pre-trigger keeps 64 samples (256 ms) before it.
+ */
+const uint16_t PRESSURE_CAPTURE_SIZE = 256;
+const uint16_t PRESSURE_CAPTURE_DEFAULT_PRE_TRIGGER = 64;
+typedef BurstCapture<PressureSample, PRESSURE_CAPTURE_SIZE> PressureCapture;
+PressureCapture pressure_capture;
+
+/** Set by "capture dump", the capture is sent in the legacy mode too */
+volatile bool is_capture_dump_requested = false;
+
+/** Bytes put into the UART by task_telemetry, "telemetry bandwidth" measures from them */
+volatile uint32_t telemetry_bytes_sent = 0;
+uint32_t telemetry_bandwidth_start_ms = 0;
+
+/**
+ * The CLI replies and the telemetry frames share the USB port. task_CLI
+ * holds it for a whole command, send_telemetry() for a whole frame, so a
+ * reply never lands in the middle of a frame.
+ */
+SemaphoreHandle_t serial_mutex = NULL;
+
 static const Command command_list[] = {
 	Command("start", start_handler),
 	Command("pause", pause_handler),
@@ -149,9 +339,15 @@ static const Command command_list[] = {
 	Command("set_tv", set_tv),
 	Command("emulate_bubble", emulate_bubble_handler),
 	Command("temp_high_limit", temp_high_limit_handler),
-	Command("temp_low_limit", temp_low_limit_handler)
+	Command("temp_low_limit", temp_low_limit_handler),
+	Command("filter", filter_handler),
+	Command("control_stats", control_stats_handler),
+	Command("modbus_stats", modbus_stats_handler),
+	Command("telemetry", telemetry_handler),
+	Command("capture", capture_handler)
 };
 
+void task_pressure_acquire(void *params);
 void task_pressure_sensor_read(void *params);
 void task_pump_control(void *params);
 void task_CLI(void *params);
@@ -159,12 +355,15 @@ void task_process_buttons(void *params);
 void task_handle_error(void *params);
 void task_temperature_sensor(void *params);
 void task_bubble_remover(void* params);
+void task_scada_slave(void *params);
+void task_telemetry(void *params);
 
 void setup()
 {
-	to_send[TO_SEND_ARRAY_SIZE - 1] = '\n';
+	Serial.begin(SERIAL_BAUD_RATE);
+	serial_mutex = xSemaphoreCreateMutex();
 
-	Serial.begin(115200);
+	begin_pump_bus();
 
 	// Configure and stop a timer (start by default)
 	Timer5.setFrequency(1);
@@ -176,13 +375,22 @@ void setup()
 	Timer3.enableISR();
 	Timer3.stop();
 
-	xTaskCreate(task_pressure_sensor_read, "PressureRead", 128, NULL, 2, NULL);
-	xTaskCreate(task_pump_control, "PumpControl", 512, NULL, 2, NULL);
+	pressure_capture.arm(PRESSURE_CAPTURE_DEFAULT_PRE_TRIGGER);
+
+	xTaskCreate(task_pressure_acquire, "PressureAcq", 160, NULL, 3, &pressure_acquire_task_handle);
+	xTaskCreate(task_pressure_sensor_read, "PressureRead", 256, NULL, 2, NULL);
+	xTaskCreate(task_pump_control, "PumpControl", 512, NULL, 2, &pump_control_task_handle);
 	xTaskCreate(task_CLI, "CLI", 256, NULL, 2, NULL);
 	xTaskCreate(task_process_buttons, "Buttons", 128, NULL, 2, NULL);
 	xTaskCreate(task_handle_error, "Errors", 128, NULL, 2, NULL);
 	xTaskCreate(task_temperature_sensor, "Temperature", 256, NULL, 2, NULL);
 	xTaskCreate(task_bubble_remover, "BubbleRemover", 128, NULL, 2, NULL);
+	xTaskCreate(task_scada_slave, "ScadaSlave", 256, NULL, 1, NULL);
+	xTaskCreate(task_telemetry, "Telemetry", 384, NULL, 2, &telemetry_task_handle);
+
+	/* Таймер поиска конца Modbus кадра от насоса (T3.5) */
+	Timer1.setPeriod(PUMP_RX_TIMER_TICK_US);
+	Timer1.enableISR();
 }
 
 void loop() {}
@@ -290,7 +498,7 @@ void set_pump_rotate_direction(const String &str)
 	// Serial.print(buff);
 
 	// Serial.println("Set the rotate direction to clockwise");
-	pump.set_rotate_direction((buff[0] == '0') ? RotateDirections::COUNTERCLOCKWISE : RotateDirections::CLOCKWISE);
+	selected_pump().set_rotate_direction((buff[0] == '0') ? RotateDirections::COUNTERCLOCKWISE : RotateDirections::CLOCKWISE);
 }
 
 void set_tv(const String &str)
@@ -298,8 +506,13 @@ void set_tv(const String &str)
 	int space_idx = str.indexOf(' ');
 
 	String target_value = str.substring(space_idx + 1, str.length());
-	pressure.set_target(target_value.toInt());
-	pid.setpoint = pressure.get_target();
+	set_target_pressure(pressure_from_int(target_value.toInt()));
+}
+
+/** A new target restarts the stabilization and the error timer */
+void set_target_pressure(const pressure_t &target)
+{
+	pressure.set_target(target);
 
 	Timer4.stop();
 	is_error_timer_start = false;
@@ -360,10 +573,688 @@ void temp_high_limit_handler(const String& str) {
 	TEMP_HIGH_LIMIT = value.toFloat();
 }
 
-void set_PID(const float &value)
+/**
+ * filter <window> <trim_percent>
+ * window - number of the last samples, 1..PRESSURE_FILTER_MAX_WINDOW
+ * trim_percent - part of the window cut from each side, 0..50 (50 is a median)
+ */
+void filter_handler(const String& str) {
+	int first_space_idx = str.indexOf(' ');
+	int second_space_idx = str.indexOf(' ', first_space_idx + 1);
+
+	if (first_space_idx < 0 || second_space_idx < 0)
+	{
+		Serial.println("ERROR: Usage: filter <window> <trim_percent>");
+		return;
+	}
+
+	long window = str.substring(first_space_idx + 1, second_space_idx).toInt();
+	long trim_percent = str.substring(second_space_idx + 1, str.length()).toInt();
+
+	if (window < 1 || window > PRESSURE_FILTER_MAX_WINDOW || trim_percent < 0 || trim_percent > 50)
+	{
+		Serial.println("ERROR: Filter settings are out of range!");
+		return;
+	}
+
+	pressure_filter_trim_percent = trim_percent;
+	pressure_filter_window = window;
+}
+
+/**
+ * control_stats - print timing of the pressure control cycle
+ * control_stats reset - start measuring from scratch
+ */
+void control_stats_handler(const String& str) {
+	if (str.indexOf("reset") >= 0)
+	{
+		control_executor.reset_stats();
+		return;
+	}
+
+	PeriodicExecutor::Stats stats = control_executor.get_stats();
+
+	Serial.print("Control period, us: ");
+	Serial.println(stats.period_us);
+	Serial.print("Cycles: ");
+	Serial.println(stats.cycle_count);
+	Serial.print("Overruns: ");
+	Serial.println(stats.overrun_count);
+	Serial.print("Execution min/max/mean, us: ");
+	Serial.print(stats.min_exec_us);
+	Serial.print(" / ");
+	Serial.print(stats.max_exec_us);
+	Serial.print(" / ");
+	Serial.println(stats.mean_exec_us);
+	Serial.print("Jitter min/max/mean, us: ");
+	Serial.print(stats.min_jitter_us);
+	Serial.print(" / ");
+	Serial.print(stats.max_jitter_us);
+	Serial.print(" / ");
+	Serial.println(stats.mean_jitter_us);
+}
+
+/**
+ * modbus_stats - print the pump bus load, errors and round trip histograms
+ * modbus_stats reset - start measuring from scratch
+ */
+void modbus_stats_handler(const String& str) {
+	Modbus &master = pump_bus.get_master();
+
+	if (str.indexOf("reset") >= 0)
+	{
+		pump_bus.reset_stats();
+		return;
+	}
+
+	const modbus_stats_t &stats = master.getStats();
+
+	uint32_t elapsed_ms = millis() - stats.u32startMs;
+
+	Serial.print("Queries/replies/errors: ");
+	Serial.print(master.getOutCnt());
+	Serial.print(" / ");
+	Serial.print(master.getInCnt());
+	Serial.print(" / ");
+	Serial.println(master.getErrCnt());
+	Serial.print("Timeouts/CRC/exceptions/bad frames: ");
+	Serial.print(stats.u16timeouts);
+	Serial.print(" / ");
+	Serial.print(stats.u16crcErrors);
+	Serial.print(" / ");
+	Serial.print(stats.u16exceptions);
+	Serial.print(" / ");
+	Serial.println(stats.u16badFrames);
+
+	ModbusQueue *queues[] = {&left_pump_queue, &right_pump_queue};
+	for (uint8_t i = 0; i < (IS_RIGHT_PUMP_INSTALLED ? 2 : 1); ++i)
+	{
+		Serial.print((i == 0) ? "Left pump retries/failed/dropped: " : "Right pump retries/failed/dropped: ");
+		Serial.print(queues[i]->get_retry_count());
+		Serial.print(" / ");
+		Serial.print(queues[i]->get_failed_count());
+		Serial.print(" / ");
+		Serial.println(queues[i]->get_dropped_count());
+	}
+
+	Serial.print("Throttled/broadcasts: ");
+	Serial.print(pump_bus.get_throttled_count());
+	Serial.print(" / ");
+	Serial.println(pump_bus.get_broadcast_count());
+	Serial.print("Duty cycle, %: ");
+	Serial.println(elapsed_ms ? stats.u32busyMs * 100.0 / elapsed_ms : 0.0);
+
+	Serial.print("Round trip buckets, us: <512");
+	for (uint8_t b = 1; b < LATENCY_BUCKETS; ++b)
+	{
+		Serial.print(" >=");
+		Serial.print(1UL << (LATENCY_MIN_LOG2 + b - 1));
+	}
+	Serial.println();
+
+	for (uint8_t i = 0; i < sizeof(fctsupported); ++i)
+	{
+		uint32_t count = 0;
+		for (uint8_t b = 0; b < LATENCY_BUCKETS; ++b)
+			count += stats.au16latency[i][b];
+
+		if (count == 0)
+			continue;
+
+		Serial.print("FC");
+		Serial.print(fctsupported[i]);
+		Serial.print(":");
+		for (uint8_t b = 0; b < LATENCY_BUCKETS; ++b)
+		{
+			Serial.print(" ");
+			Serial.print(stats.au16latency[i][b]);
+		}
+		Serial.println();
+	}
+}
+
+/**
+ * telemetry legacy - raw status frames ending with '\n' (default)
+ * telemetry framed - COBS frames with CRC, see telemetry.h
+ * telemetry decimate <field> <ratio> - stream the field in every ratio-th
+ *     slot of TELEMETRY_STREAM_RATE_HZ, 0 - don't stream it (framed mode only)
+ * telemetry compact <N> - compact stream frames with a keyframe every N frames, 0 - off
+ * telemetry bandwidth - print the ratios and the load of the serial port
+ */
+void telemetry_handler(const String& str) {
+	if (str.indexOf("decimate") >= 0)
+		telemetry_decimate(str);
+	else if (str.indexOf("compact") >= 0)
+		telemetry_compact(str);
+	else if (str.indexOf("bandwidth") >= 0)
+		print_telemetry_bandwidth();
+	else if (str.indexOf("framed") >= 0)
+		telemetry_mode = TELEMETRY_MODE_FRAMED;
+	else if (str.indexOf("legacy") >= 0)
+		telemetry_mode = TELEMETRY_MODE_LEGACY;
+	else
+		Serial.println("ERROR: Usage: telemetry <legacy|framed|decimate <field> <ratio>|compact <N>|bandwidth>");
+}
+
+void telemetry_compact(const String& str) {
+	int space_idx = str.indexOf(' ', str.indexOf("compact"));
+
+	if (space_idx < 0)
+	{
+		Serial.println("ERROR: Usage: telemetry compact <N>");
+		return;
+	}
+
+	long key_interval = str.substring(space_idx + 1, str.length()).toInt();
+
+	if (key_interval < 0 || key_interval > 255)
+	{
+		Serial.println("ERROR: Keyframe interval is out of range 0..255!");
+		return;
+	}
+
+	telemetry_delta_encoder.set_key_interval(key_interval);
+}
+
+void telemetry_decimate(const String& str) {
+	int first_space_idx = str.indexOf(' ', str.indexOf("decimate"));
+	int second_space_idx = str.indexOf(' ', first_space_idx + 1);
+
+	if (first_space_idx < 0 || second_space_idx < 0)
+	{
+		Serial.println("ERROR: Usage: telemetry decimate <field> <ratio>");
+		return;
+	}
+
+	String name = str.substring(first_space_idx + 1, second_space_idx);
+	long ratio = str.substring(second_space_idx + 1, str.length()).toInt();
+
+	TelemetryField field;
+
+	if (!telemetry_field_from_name(name.c_str(), field))
+	{
+		Serial.print("ERROR: Unknown field, one of:");
+		for (uint8_t i = 0; i < TELEMETRY_FIELD_COUNT; ++i)
+		{
+			Serial.print(" ");
+			Serial.print(telemetry_field_name(i));
+		}
+		Serial.println();
+		return;
+	}
+
+	if (ratio < 0 || ratio > 255)
+	{
+		Serial.println("ERROR: Ratio is out of range 0..255!");
+		return;
+	}
+
+	telemetry_decimator.set_ratio(field, ratio);
+}
+
+/** Expected load from the settings and the measured one since the last call */
+void print_telemetry_bandwidth() {
+	Serial.print("Stream slots, Hz: ");
+	Serial.println(TELEMETRY_STREAM_RATE_HZ);
+
+	for (uint8_t i = 0; i < TELEMETRY_FIELD_COUNT; ++i)
+	{
+		uint8_t ratio = telemetry_decimator.get_ratio((TelemetryField)i);
+
+		Serial.print(telemetry_field_name(i));
+		Serial.print(": ");
+		if (ratio == 0)
+		{
+			Serial.println("off");
+			continue;
+		}
+		Serial.print(ratio);
+		Serial.print(" (");
+		Serial.print((float)TELEMETRY_STREAM_RATE_HZ / ratio, 1);
+		Serial.println(" Hz)");
+	}
+
+	uint16_t status_bytes;
+	uint16_t stream_bytes = 0;
+
+	if (telemetry_mode == TELEMETRY_MODE_LEGACY)
+		status_bytes = TO_SEND_ARRAY_SIZE;
+	else
+	{
+		status_bytes = TELEMETRY_STATUS_PAYLOAD_SIZE + TELEMETRY_FRAME_OVERHEAD +
+					   (TELEMETRY_MODBUS_STATS_PAYLOAD_SIZE + TELEMETRY_FRAME_OVERHEAD) / TELEMETRY_MODBUS_STATS_PERIOD;
+		stream_bytes = telemetry_decimator.get_bytes_per_second();
+	}
+
+	/* 8N1 - 10 bits on the wire per byte */
+	uint32_t capacity = SERIAL_BAUD_RATE / 10;
+	uint32_t expected_bytes = status_bytes + stream_bytes;
+
+	/* The compact frames are smaller, only the measured load shows by how much */
+	Serial.print("Compact stream frames: ");
+	if (telemetry_delta_encoder.get_key_interval() == 0)
+		Serial.println("off");
+	else
+	{
+		Serial.print("keyframe every ");
+		Serial.println(telemetry_delta_encoder.get_key_interval());
+	}
+
+	Serial.print("Status/stream, B/s: ");
+	Serial.print(status_bytes);
+	Serial.print(" / ");
+	Serial.println(stream_bytes);
+	Serial.print("Expected, B/s: ");
+	Serial.print(expected_bytes);
+	Serial.print(" of ");
+	Serial.print(capacity);
+	Serial.print(" (");
+	Serial.print(expected_bytes * 100.0 / capacity, 1);
+	Serial.println(" %)");
+
+	taskENTER_CRITICAL();
+	uint32_t sent_bytes = telemetry_bytes_sent;
+	telemetry_bytes_sent = 0;
+	taskEXIT_CRITICAL();
+
+	uint32_t now = millis();
+	uint32_t elapsed_ms = now - telemetry_bandwidth_start_ms;
+	telemetry_bandwidth_start_ms = now;
+
+	if (elapsed_ms != 0)
+	{
+		float measured_bytes = sent_bytes * 1000.0 / elapsed_ms;
+
+		Serial.print("Measured since the last call, B/s: ");
+		Serial.print(measured_bytes, 0);
+		Serial.print(" (");
+		Serial.print(measured_bytes * 100 / capacity, 1);
+		Serial.println(" %)");
+	}
+
+	Serial.print("Stream points dropped: ");
+	Serial.println(telemetry_points.get_overflow_count());
+}
+
+/**
+ * capture - print the state of the raw pressure capture
+ * capture arm [pre_trigger] - record again, keep pre_trigger samples before the trigger
+ * capture trigger - trigger it now
+ * capture dump - send the frozen capture again, in the legacy mode too
+ */
+void capture_handler(const String& str) {
+	if (str.indexOf("arm") >= 0)
+	{
+		int space_idx = str.indexOf(' ', str.indexOf("arm"));
+		long pre_trigger = (space_idx < 0) ? PRESSURE_CAPTURE_DEFAULT_PRE_TRIGGER :
+							str.substring(space_idx + 1, str.length()).toInt();
+
+		if (pre_trigger < 0 || pre_trigger >= PRESSURE_CAPTURE_SIZE)
+		{
+			Serial.println("ERROR: Pre-trigger is out of range!");
+			return;
+		}
+
+		pressure_capture.arm(pre_trigger);
+		return;
+	}
+
+	if (str.indexOf("trigger") >= 0)
+	{
+		if (!pressure_capture.trigger(AlertType::NONE))
+			Serial.println("ERROR: Capture isn't armed!");
+		return;
+	}
+
+	if (str.indexOf("dump") >= 0)
+	{
+		if (pressure_capture.get_state() != PressureCapture::DONE)
+		{
+			Serial.println("ERROR: Nothing is captured yet!");
+			return;
+		}
+
+		is_capture_dump_requested = true;
+		xTaskNotify(telemetry_task_handle, TELEMETRY_NOTIFY_CAPTURE, eSetBits);
+		return;
+	}
+
+	const char *state_names[] = {"idle", "armed", "triggered", "done"};
+
+	Serial.print("Capture ");
+	Serial.print(pressure_capture.get_id());
+	Serial.print(": ");
+	Serial.println(state_names[pressure_capture.get_state()]);
+
+	if (pressure_capture.get_state() != PressureCapture::DONE)
+		return;
+
+	Serial.print("Samples/trigger index/reason: ");
+	Serial.print(pressure_capture.get_count());
+	Serial.print(" / ");
+	Serial.print(pressure_capture.get_trigger_index());
+	Serial.print(" / ");
+	Serial.println(pressure_capture.get_reason());
+}
+
+/** Alerts as one bit each, the first code (NONE) is skipped */
+uint8_t pack_alerts()
+{
+	uint8_t alert_byte = 0;
+	for (uint8_t i = 1; i < alert_size; i++) {
+		alert_byte |= (alert[i] & 0b1) << (i - 1);
+	}
+	return alert_byte;
+}
+
+/** Called once per control cycle, SCADA reads only this copy */
+void publish_scada_snapshot()
+{
+	int16_t registers[SCADA_REGISTER_COUNT] = {0};
+
+	registers[SCADA_PRESSURE] = (pressure.get_value() * 10) >> PRESSURE_FRACTION_BITS;
+	registers[SCADA_TEMPERATURE1] = temperature1 * 10;
+	registers[SCADA_TEMPERATURE2] = temperature2 * 10;
+	registers[SCADA_FLOW] = selected_pump().get_actual_speed() * perfusion_ratio * 10;
+	registers[SCADA_PUMP_SPEED] = selected_pump().get_actual_speed() * 10;
+	registers[SCADA_REGIME] = regime_state;
+	registers[SCADA_KIDNEY] = kidney_selector;
+	registers[SCADA_IS_BLOCKED] = is_blocked;
+	registers[SCADA_ALERTS] = pack_alerts();
+	registers[SCADA_PERIPHERAL_STATUS] = peripheral_status.pack_to_byte();
+	registers[SCADA_SESSION_MINUTES] = time.get_hours() * 60 + time.get_mins();
+	registers[SCADA_SESSION_SECONDS] = time.get_secs();
+
+	registers[SCADA_TARGET_PRESSURE] = pressure.get_target() >> PRESSURE_FRACTION_BITS;
+	registers[SCADA_TEMP_LOW_LIMIT] = TEMP_LOW_LIMIT * 10;
+	registers[SCADA_TEMP_HIGH_LIMIT] = TEMP_HIGH_LIMIT * 10;
+	registers[SCADA_PERFUSION_RATIO] = perfusion_ratio * 1000;
+
+	scada.publish(registers);
+}
+
+/** Called once per control cycle, the telemetry frame is packed from this copy */
+void publish_telemetry_snapshot()
+{
+	TelemetrySnapshot &snapshot = telemetry_snapshot.back();
+
+	snapshot.flow = selected_pump().get_actual_speed() * perfusion_ratio;
+	snapshot.pressure = pressure_to_float(pressure.get_value());
+	snapshot.temperature1 = temperature1;
+	snapshot.temperature2 = temperature2;
+	snapshot.packed_state = (regime_state) |
+							(kidney_selector << 3) |
+							(is_blocked << 4);
+	snapshot.alerts = pack_alerts();
+	snapshot.peripheral_status = peripheral_status.pack_to_byte();
+	snapshot.target = pressure_to_float(pressure.get_target());
+
+	telemetry_snapshot.publish();
+}
+
+/** flow, pressure, temp1, temp2, time, packed byte, alerts, peripheral status, target */
+void pack_status_payload(const TelemetrySnapshot &snapshot, const Time &frame_time, uint8_t *payload)
 {
-	pid.input = value;
-	pump.set_speed(pid.getResultTimer());
+	uint8_t* p_writer = payload;
+
+	memcpy(p_writer, &snapshot.flow, 4);
+	p_writer += 4;
+	memcpy(p_writer, &snapshot.pressure, 4);
+	p_writer += 4;
+	memcpy(p_writer, &snapshot.temperature1, 4);
+	p_writer += 4;
+	memcpy(p_writer, &snapshot.temperature2, 4);
+	p_writer += 4;
+
+	*(p_writer++) = frame_time.get_hours();
+	*(p_writer++) = frame_time.get_mins();
+	*(p_writer++) = frame_time.get_secs();
+
+	*(p_writer++) = snapshot.packed_state;
+	*(p_writer++) = snapshot.alerts;
+	*(p_writer++) = snapshot.peripheral_status;
+
+	memcpy(p_writer, &snapshot.target, 4);
+}
+
+/**
+ * TELEMETRY_FRAME_STREAM: slot, field mask, the fields of the mask.
+ * The pressure comes from the point, the slow fields from the snapshot.
+ */
+uint8_t pack_stream_payload(const TelemetryPressurePoint &point, const uint8_t &mask,
+							const TelemetrySnapshot &snapshot, uint8_t *payload)
+{
+	uint8_t* p_writer = payload;
+
+	memcpy(p_writer, &point.slot, 2);
+	p_writer += 2;
+	*(p_writer++) = mask;
+
+	for (uint8_t i = 0; i < TELEMETRY_FIELD_COUNT; ++i)
+	{
+		if (!(mask & (1 << i)))
+			continue;
+
+		float value;
+
+		switch (i)
+		{
+		case TELEMETRY_FIELD_PRESSURE:
+			value = pressure_to_float(point.pressure);
+			break;
+		case TELEMETRY_FIELD_PRESSURE_MEAN:
+			value = pressure_to_float(point.pressure_mean);
+			break;
+		case TELEMETRY_FIELD_FLOW:
+			value = snapshot.flow;
+			break;
+		case TELEMETRY_FIELD_TEMPERATURE1:
+			value = snapshot.temperature1;
+			break;
+		case TELEMETRY_FIELD_TEMPERATURE2:
+			value = snapshot.temperature2;
+			break;
+		case TELEMETRY_FIELD_TARGET:
+			value = snapshot.target;
+			break;
+		default:
+			*(p_writer++) = snapshot.packed_state;
+			*(p_writer++) = snapshot.alerts;
+			*(p_writer++) = snapshot.peripheral_status;
+			continue;
+		}
+
+		memcpy(p_writer, &value, 4);
+		p_writer += 4;
+	}
+
+	return p_writer - payload;
+}
+
+/**
+ * TELEMETRY_FRAME_MODBUS_STATS: uint16 each, little endian -
+ * queries, replies, errors, timeouts, CRC errors, exceptions, bad frames,
+ * retries, failed, dropped (all the pumps), duty cycle in 0.1 %.
+ * Read without locking the pump task, a counter may be one update behind.
+ */
+uint8_t pack_modbus_stats_payload(uint8_t *payload)
+{
+	Modbus &master = pump_bus.get_master();
+	const modbus_stats_t &stats = master.getStats();
+
+	uint32_t elapsed_ms = millis() - stats.u32startMs;
+
+	uint16_t values[] = {
+		master.getOutCnt(),
+		master.getInCnt(),
+		master.getErrCnt(),
+		stats.u16timeouts,
+		stats.u16crcErrors,
+		stats.u16exceptions,
+		stats.u16badFrames,
+		(uint16_t)(left_pump_queue.get_retry_count() + right_pump_queue.get_retry_count()),
+		(uint16_t)(left_pump_queue.get_failed_count() + right_pump_queue.get_failed_count()),
+		(uint16_t)(left_pump_queue.get_dropped_count() + right_pump_queue.get_dropped_count()),
+		(uint16_t)(elapsed_ms ? stats.u32busyMs * 1000 / elapsed_ms : 0)
+	};
+
+	static_assert(sizeof(values) == TELEMETRY_MODBUS_STATS_PAYLOAD_SIZE, "Modbus stats don't match the payload size");
+	static_assert(sizeof(values) <= TELEMETRY_MAX_PAYLOAD, "Modbus stats don't fit into a telemetry frame");
+
+	memcpy(payload, values, sizeof(values));
+	return sizeof(values);
+}
+
+/** The UART interrupt empties the TX ring, the task sleeps until the frame fits */
+void send_telemetry(const uint8_t *frame, const uint8_t &size)
+{
+	xSemaphoreTake(serial_mutex, portMAX_DELAY);
+
+	while (Serial.availableForWrite() < size)
+		vTaskDelay(1);
+
+	Serial.write(frame, size);
+	telemetry_bytes_sent += size;
+
+	xSemaphoreGive(serial_mutex);
+}
+
+bool is_telemetry_streaming()
+{
+	return telemetry_mode == TELEMETRY_MODE_FRAMED && telemetry_decimator.is_enabled();
+}
+
+/** One frame per pressure point, the slots with no field due are skipped */
+void send_stream_frames(const TelemetrySnapshot &snapshot)
+{
+	TelemetryPressurePoint point;
+
+	while (telemetry_points.pop(point))
+	{
+		/* The mode or the ratios may have been changed since the point was taken */
+		uint8_t mask = telemetry_decimator.get_due_mask(point.slot);
+
+		if (mask == 0 || telemetry_mode != TELEMETRY_MODE_FRAMED)
+			continue;
+
+		if (telemetry_delta_encoder.get_key_interval() == 0)
+		{
+			uint8_t payload[TELEMETRY_MAX_PAYLOAD];
+			uint8_t payload_size = pack_stream_payload(point, mask, snapshot, payload);
+
+			uint8_t frame_size = telemetry_framer.build(TELEMETRY_FRAME_STREAM, payload, payload_size, telemetry_frame);
+			send_telemetry(telemetry_frame, frame_size);
+			continue;
+		}
+
+		int32_t values[TELEMETRY_FIELD_COUNT];
+		quantize_stream_fields(point, snapshot, values);
+
+		/* The points of one control cycle share a frame until it is full */
+		while (!telemetry_delta_encoder.add(point.slot, mask, telemetry_decimator.get_enabled_mask(),
+											values, telemetry_framer.get_sequence()))
+			send_compact_frame();
+	}
+
+	if (!telemetry_delta_encoder.is_empty())
+		send_compact_frame();
+}
+
+void send_compact_frame()
+{
+	TelemetryFrameType type;
+	uint8_t payload_size;
+	const uint8_t *payload = telemetry_delta_encoder.finish(type, payload_size);
+
+	uint8_t frame_size = telemetry_framer.build(type, payload, payload_size, telemetry_frame);
+	send_telemetry(telemetry_frame, frame_size);
+}
+
+/**
+ * TELEMETRY_FRAME_CAPTURE: capture id, reason (AlertType, NONE - the CLI),
+ * sample count (uint16), trigger index (uint16), index of the first sample
+ * in this frame (uint16), then the samples as raw (int16) and timestamp_us
+ * (uint32), all little endian. Stops if the capture is armed again in the middle.
+ */
+void send_capture_frames()
+{
+	const uint8_t HEADER_SIZE = 8;
+	const uint8_t SAMPLE_SIZE = 6;
+	const uint8_t SAMPLES_PER_FRAME = (TELEMETRY_MAX_PAYLOAD - HEADER_SIZE) / SAMPLE_SIZE;
+
+	uint16_t count = pressure_capture.get_count();
+	uint16_t trigger_index = pressure_capture.get_trigger_index();
+
+	for (uint16_t first = 0; first < count; first += SAMPLES_PER_FRAME)
+	{
+		if (pressure_capture.get_state() != PressureCapture::DONE)
+			return;
+
+		uint8_t payload[TELEMETRY_MAX_PAYLOAD];
+		uint8_t payload_size = 0;
+
+		payload[payload_size++] = pressure_capture.get_id();
+		payload[payload_size++] = pressure_capture.get_reason();
+		memcpy(&payload[payload_size], &count, 2);
+		payload_size += 2;
+		memcpy(&payload[payload_size], &trigger_index, 2);
+		payload_size += 2;
+		memcpy(&payload[payload_size], &first, 2);
+		payload_size += 2;
+
+		for (uint16_t i = first; i < count && i < first + SAMPLES_PER_FRAME; ++i)
+		{
+			const PressureSample &sample = pressure_capture.get(i);
+
+			memcpy(&payload[payload_size], &sample.raw, 2);
+			payload_size += 2;
+			memcpy(&payload[payload_size], &sample.timestamp_us, 4);
+			payload_size += 4;
+		}
+
+		uint8_t frame_size = telemetry_framer.build(TELEMETRY_FRAME_CAPTURE, payload, payload_size, telemetry_frame);
+		send_telemetry(telemetry_frame, frame_size);
+	}
+}
+
+/** All the stream fields in 1 / telemetry_field_scale() of their unit */
+void quantize_stream_fields(const TelemetryPressurePoint &point, const TelemetrySnapshot &snapshot, int32_t *values)
+{
+	values[TELEMETRY_FIELD_PRESSURE] = telemetry_quantize(TELEMETRY_FIELD_PRESSURE, pressure_to_float(point.pressure));
+	values[TELEMETRY_FIELD_PRESSURE_MEAN] = telemetry_quantize(TELEMETRY_FIELD_PRESSURE_MEAN,
+															   pressure_to_float(point.pressure_mean));
+	values[TELEMETRY_FIELD_FLOW] = telemetry_quantize(TELEMETRY_FIELD_FLOW, snapshot.flow);
+	values[TELEMETRY_FIELD_TEMPERATURE1] = telemetry_quantize(TELEMETRY_FIELD_TEMPERATURE1, snapshot.temperature1);
+	values[TELEMETRY_FIELD_TEMPERATURE2] = telemetry_quantize(TELEMETRY_FIELD_TEMPERATURE2, snapshot.temperature2);
+	values[TELEMETRY_FIELD_TARGET] = telemetry_quantize(TELEMETRY_FIELD_TARGET, snapshot.target);
+	values[TELEMETRY_FIELD_STATE] = snapshot.packed_state |
+									((int32_t)snapshot.alerts << 8) |
+									((int32_t)snapshot.peripheral_status << 16);
+}
+
+/**
+ * The same as the CLI commands set_tv, temp_*_limit and set_perfusion_speed_ratio.
+ * ScadaSlave has refused the values out of SCADA_SETPOINT_RANGES already.
+ */
+void apply_scada_setpoints(const uint8_t &changed_mask)
+{
+	if (changed_mask & (1 << (SCADA_TARGET_PRESSURE - SCADA_FIRST_SETPOINT)))
+		set_target_pressure(pressure_from_int(scada.get_register(SCADA_TARGET_PRESSURE)));
+
+	if (changed_mask & (1 << (SCADA_TEMP_LOW_LIMIT - SCADA_FIRST_SETPOINT)))
+		TEMP_LOW_LIMIT = scada.get_register(SCADA_TEMP_LOW_LIMIT) / 10.0;
+
+	if (changed_mask & (1 << (SCADA_TEMP_HIGH_LIMIT - SCADA_FIRST_SETPOINT)))
+		TEMP_HIGH_LIMIT = scada.get_register(SCADA_TEMP_HIGH_LIMIT) / 10.0;
+
+	if (changed_mask & (1 << (SCADA_PERFUSION_RATIO - SCADA_FIRST_SETPOINT)))
+		perfusion_ratio = scada.get_register(SCADA_PERFUSION_RATIO) / 1000.0;
+}
+
+void set_PID(const pressure_t &value)
+{
+	int32_t speed = pid.compute(pressure.get_target(), value);
+	selected_pump().set_speed((float)speed / PRESSURE_ONE);
 }
 
 void check_button(const uint8_t &button_number)
@@ -493,6 +1384,8 @@ void kidney_handler(const uint8_t &btnState)
 	{
 		kidney_flag = true;
 
+		Pump &previous_pump = selected_pump();
+
 		if (kidney_selector == KidneyState::LEFT_KIDNEY)
 		{
 			kidney_selector = KidneyState::RIGHT_KIDNEY;
@@ -503,6 +1396,10 @@ void kidney_handler(const uint8_t &btnState)
 			kidney_selector = KidneyState::LEFT_KIDNEY;
 			// Serial.println("Left kidney selected");
 		}
+
+		/* Nothing controls the pressure of the deselected kidney, its pump must not keep running */
+		if (&selected_pump() != &previous_pump)
+			previous_pump.request_stop(10);
 	}
 	if (btnState && kidney_flag)
 	{
@@ -510,69 +1407,42 @@ void kidney_handler(const uint8_t &btnState)
 	}
 }
 
+/**
+ * Session clock. The frame is sent by task_telemetry, the UART may not
+ * have room for it and waiting here would block all the interrupts.
+ */
 ISR(TIMER5_A)
 {
-	/* Write flow */
-	float flow = pump.get_speed() * perfusion_ratio;
-	uint8_t* magic = ((uint8_t*)(&flow));
-	uint8_t* p_writer = to_send;
-
-	for(uint8_t i = 0; i < 4; i++) {
-		*(p_writer++) = magic[i];
-	}
-
-	/* Write pressure */
-	magic = ((uint8_t*)(&pressure.get_value()));
-
-	for(uint8_t i = 0; i < 4; i++) {
-		*(p_writer++) = magic[i];
-	}
-
-	/* Write temp1 */
-	magic = ((uint8_t*)(&temperature1));
-
-	for(uint8_t i = 0; i < 4; i++) {
-		*(p_writer++) = magic[i];
-	}
-
-	/* Write temp2 */
-	magic = ((uint8_t*)(&temperature2));
-
-	for(uint8_t i = 0; i < 4; i++) {
-		*(p_writer++) = magic[i];
-	}
+	/* The frame carries the time before the increment */
+	telemetry_time = time;
+	++time;
 
-	/* Write time */
-	*(p_writer++) = time.get_hours();
-	*(p_writer++) = time.get_mins();
-	*(p_writer++) = time.get_secs();
+	if (telemetry_task_handle == NULL)
+		return;
 
-	/* Write packed regime + kidney_selector + is_blocked */
-	uint8_t packed_byte = (regime_state) | 
-						  (kidney_selector << 3) |
-						  (is_blocked << 4);
-	*(p_writer++) = packed_byte;
+	BaseType_t is_higher_priority_task_woken = pdFALSE;
+	xTaskNotifyFromISR(telemetry_task_handle, TELEMETRY_NOTIFY_SESSION_TICK, eSetBits,
+					   &is_higher_priority_task_woken);
 
-	/* Write alert */
-	/* Skip first code - NONE */
-	uint8_t alert_byte = 0;
-	for (uint8_t i = 1; i < alert_size; i++) {
-		alert_byte |= (alert[i] & 0b1) << (i - 1);
-	}
-	*(p_writer++) = alert_byte;
-
-	uint8_t peripheral_status_byte = peripheral_status.pack_to_byte();
-	*(p_writer++) = peripheral_status_byte;
+	if (is_higher_priority_task_woken == pdTRUE)
+		portYIELD_FROM_ISR();
+}
 
-	magic = ((uint8_t*)(&pressure.get_target()));
-	for(uint8_t i = 0; i < 4; i++) {
-		*(p_writer++) = magic[i];
-	}
+/**
+ * Modbus inter-character timer. The USART RX interrupt belongs to the
+ * Arduino core, so the received byte count is checked here instead and the
+ * pump task is woken up right after T3.5 of silence.
+ */
+ISR(TIMER1_A)
+{
+	if (!pump_master.rxTimerTick() || pump_control_task_handle == NULL)
+		return;
 
-	++time;
+	BaseType_t is_higher_priority_task_woken = pdFALSE;
+	vTaskNotifyGiveFromISR(pump_control_task_handle, &is_higher_priority_task_woken);
 
-	/** TODO: Add messages to queue and send it to COM port outside of the interrupt */
-	Serial.write(to_send, TO_SEND_ARRAY_SIZE);
+	if (is_higher_priority_task_woken == pdTRUE)
+		portYIELD_FROM_ISR();
 }
 
 ISR(TIMER4_A)
@@ -590,7 +1460,7 @@ ISR(TIMER4_A)
 		// Block the system
 		is_system_blocked = true;
 		regime_state = Regime::BLOCKED;
-		pump.stop();
+		is_emergency_stop_requested = true;
 	}
 }
 
@@ -612,170 +1482,252 @@ ISR(TIMER3_A)
 
 }
 
-void task_pressure_sensor_read(void *params)
+/**
+ * ALERT/RDY falling edge - the ADS1115 has finished a conversion.
+ * The I2C read can't be done here: Wire waits for the TWI interrupt,
+ * which never comes while we are inside another ISR. So we only save
+ * the timestamp and wake up task_pressure_acquire.
+ */
+void ads_ready_isr()
 {
-	Adafruit_ADS1115 ads;
+	ads_ready_timestamp_us = micros();
+
+	BaseType_t is_higher_priority_task_woken = pdFALSE;
+	vTaskNotifyGiveFromISR(pressure_acquire_task_handle, &is_higher_priority_task_woken);
 
+	if (is_higher_priority_task_woken == pdTRUE)
+		portYIELD_FROM_ISR();
+}
+
+void task_pressure_acquire(void *params)
+{
 	ads.setGain(GAIN_SIXTEEN);
-	if (!ads.begin())
+	ads.setDataRate(ADS_DATA_RATE);
+
+	peripheral_status.is_pressure_sensor_online = ads.begin();
+
+	// Start continuous conversions, ALERT/RDY pulses after each of them
+	ads.startADCReading(ADS1X15_REG_CONFIG_MUX_DIFF_0_1, /*continuous=*/true);
+
+#if PRESSURE_SENSOR_USE_ALERT_RDY
+	pinMode(Pin::ads_alert_pin, INPUT_PULLUP);
+	attachInterrupt(digitalPinToInterrupt(Pin::ads_alert_pin), ads_ready_isr, FALLING);
+#endif
+
+	PressureSample sample;
+
+	for (;;)
 	{
-		// Serial.println("Failed to initialize ADS.");
-		// while (1);
-		peripheral_status.is_pressure_sensor_online = false;
-	}
-	else 
+#if PRESSURE_SENSOR_USE_ALERT_RDY
+		uint32_t ready_count = ulTaskNotifyTake(pdTRUE, ADS_ALERT_TIMEOUT_TICKS);
+
+		if (ready_count == 0)
+		{
+			peripheral_status.is_pressure_sensor_online = false;
+			continue;
+		}
+
+		/* The ADS1115 keeps only the last result, older ones are lost */
+		ads_missed_conversions += ready_count - 1;
+		sample.timestamp_us = ads_ready_timestamp_us;
+#else
+		vTaskDelay(PRESSURE_SENSOR_TICK_RATE / 16);
+		sample.timestamp_us = micros();
+#endif
+
+		sample.raw = ads.getLastConversionResults();
 		peripheral_status.is_pressure_sensor_online = true;
 
+		pressure_samples.push(sample);
 
-	// Serial.println("ADC initialized successfully");
+		/* Снимок сырых отсчётов вокруг события, выгружает его task_telemetry */
+		if (pressure_capture.push(sample) && telemetry_task_handle != NULL)
+			xTaskNotify(telemetry_task_handle, TELEMETRY_NOTIFY_CAPTURE, eSetBits);
+	}
+}
 
-	// Start continuous conversions.
-	ads.startADCReading(ADS1X15_REG_CONFIG_MUX_DIFF_0_1, /*continuous=*/true);
+void task_pressure_sensor_read(void *params)
+{
+	/**
+	 * Сглаживание на каждый отсчёт с коэффициентом PRESSURE_SMOOTHING_K,
+	 * при 250 SPS это 55 / 65536 = 1/1192. Разница меньше 1192 единиц
+	 * состояния (0.02 мм рт. ст.) уже не двигает его, это ниже разрешения датчика.
+	 */
+	ExponentialSmoother<pressure_t> pressure_smoother(PRESSURE_SMOOTHING_K);
+	pressure_smoother.reset(pressure.get_value());
 
-	float k = 0.2;
+	/* Пределы скорости насоса */
+	pid.set_limits(1 * PRESSURE_ONE, 100 * PRESSURE_ONE);
 
-	pid.setDirection(NORMAL); // направление регулирования (NORMAL/REVERSE). ПО УМОЛЧАНИЮ СТОИТ NORMAL
-	pid.setLimits(1, 100);	  // пределы (ставим для 8 битного ШИМ). ПО УМОЛЧАНИЮ СТОЯТ 0 И 255
-	pid.setpoint = pressure.get_target();
+	/* Нужен, чтобы заметить включение ПИД и переключиться безударно */
+	bool is_pid_running = false;
+	Pump *controlled_pump = &selected_pump();
 
-	uint8_t counter = 0;
-	float pressure_sum = 0;
-	float average_sistal[10];
+	/* Снимок запускается только на входе за пределы давления */
+	bool was_out_of_limits = false;
+
+	const uint8_t SAMPLE_BATCH_SIZE = 8;
+	PressureSample samples[SAMPLE_BATCH_SIZE];
 
 	for (;;)
 	{
+		/* Ждём начала следующего цикла управления, период не плывёт */
+		control_executor.wait_next_cycle();
+
+		/* Отдаём SCADA и телеметрии результаты прошлого цикла */
+		publish_scada_snapshot();
+		publish_telemetry_snapshot();
+
+		/* При смене почки ПИД безударно подхватывает скорость её насоса */
+		Pump &pump = selected_pump();
+		if (&pump != controlled_pump)
+		{
+			controlled_pump = &pump;
+			is_pid_running = false;
+		}
+
 		/* Если система упала в блокировку, то тупо ничего не делаем */
 		if (is_system_blocked)
 		{
-			vTaskDelay(1000);
+			pressure_samples.clear();
 			continue;
 		}
 
-		/**
-		 * Производим усреднение по 10-ти значениям
-		 * 
-		 * TODO: Загнать количество точек усреднения в константу или переменную,
-		 * если хотим управлять ей через СОМ порт
-		 * 
-		 * TODO: Можно сделать плавающую среднюю по последним N значениям
-		 */
-
-		if (counter < 10) {
-			/* Читаем данные с АЦП */
-			int16_t raw_data = ads.getLastConversionResults();
+		/* Применяем новые настройки фильтра, если их поменяли через СОМ порт */
+		if (pressure_filter.get_window_size() != pressure_filter_window ||
+			pressure_filter.get_trim_percent() != pressure_filter_trim_percent)
+		{
+			pressure_filter.configure(pressure_filter_window, pressure_filter_trim_percent);
+		}
 
-			/* Преобразуем значение давления по формуле */
-			float converted_value = raw_data * 7.8125 / 25 - pressure.get_tare();
+		bool is_new_value = false;
+		bool is_new_stream_point = false;
+		uint8_t sample_count;
 
-			/* Сохраняем средние значения */
-			average_sistal[counter] = converted_value;
-			++counter;
-		}
-		else {
-			/** TODO: А что мы тут проверяем?
-			 * Зачем нам блокировать вычисление средней, если идёт парсинг с СОМ порта?
-			 * Я так понимаю, тут мы производим усреднение\
-			 * Тут мы можем улететь в бесконечный цикл
-			 */
-			if (is_data_transmitted == false)
+		/* Забираем из кольцевого буфера всё, что накопилось с прошлого раза */
+		while ((sample_count = pressure_samples.pop_batch(samples, SAMPLE_BATCH_SIZE)) > 0)
+		{
+			for (uint8_t s = 0; s < sample_count; ++s)
 			{
-				// pressure += ((pressure_sum / counter) - pressure) * k;
-				// Serial.println(pressure);
+				/* Преобразуем значение давления по формуле */
+				pressure_t converted_value = pressure_from_raw(samples[s].raw) - pressure.get_tare();
 
 				/**
-				 * Сортировка пузырьком, почему так? 
-				 * TODO: Применить нормальную сортировку
+				 * Усечённое среднее по скользящему окну - новое значение
+				 * на каждый отсчёт, а не на каждые 10
 				 */
+				pressure_t average_value = pressure_filter.push(converted_value);
 
-				int i, j;
-				bool swapped;
-				for (i = 0; i < 10 - 1; i++)
-				{
-					swapped = false;
-					for (j = 0; j < 10 - i - 1; j++)
-					{
-						if (average_sistal[j] > average_sistal[j + 1])
-						{
-							/* Тут вообще swap отвалился */
-							// swap(float, average_sistal[j], average_sistal[j + 1]);
-							float tmp = average_sistal[j];
-							average_sistal[j] = average_sistal[j + 1];
-							average_sistal[j + 1] = tmp;
-							swapped = true;
-						}
-					}
-
-					// If no two elements were swapped
-					// by inner loop, then break
-					if (swapped == false)
-						break;
-				}
-
-				/* Выбираем элементы с 4-го по 8-й */
-				for (uint8_t i = 0; i < 5; ++i)
+				/**
+				 * Снимок запускаем по выходу усечённого среднего за пределы,
+				 * а не по тревоге: та смотрит на сглаженное давление раз в
+				 * ~0.9 с, и скачок к тому времени уже прошёл
+				 */
+				bool is_out_of_limits = average_value > pressure.get_high_limit() ||
+										average_value < pressure.get_low_limit();
+				if (is_out_of_limits && !was_out_of_limits)
 				{
-					pressure_sum += average_sistal[4 + i];
+					pressure_capture.trigger(average_value > pressure.get_high_limit() ?
+											 AlertType::PRESSURE_HIGH : AlertType::PRESSURE_LOW);
 				}
+				was_out_of_limits = is_out_of_limits;
 
-				/* Вычисляем среднее */
-				float average_value = pressure_sum / 5;
+				/** TODO: А что мы тут проверяем?
+				 * Зачем нам блокировать вычисление средней, если идёт парсинг с СОМ порта?
+				 */
+				if (is_data_transmitted == true)
+					continue;
 
 				/* Душим скачки давления */
-				float pressure_tmp = (average_value - pressure.get_value()) * k;
-				pressure.set_value(pressure.get_value() + pressure_tmp);
+				pressure.set_value(pressure_smoother.push(average_value));
+
+				is_new_value = true;
+
+				/* Поток телеметрии - первый отсчёт в каждом слоте по его времени */
+				uint16_t slot;
+				if (telemetry_stream_clock.advance(samples[s].timestamp_us, slot) && is_telemetry_streaming())
+				{
+					TelemetryPressurePoint point = {slot, pressure.get_value(), average_value};
 
-				pressure_sum = 0;
+					if (telemetry_points.push(point))
+						is_new_stream_point = true;
+				}
+			}
+		}
+
+		if (is_new_stream_point && telemetry_task_handle != NULL)
+			xTaskNotify(telemetry_task_handle, TELEMETRY_NOTIFY_STREAM, eSetBits);
 
-				/* В первом режиме включаем минимальную скорость и запускаем ПИД */
-				if (regime_state == Regime::REGIME1)
+		/* Управляем насосом только по свежему значению давления */
+		if (is_new_value)
+		{
+			/* В первом режиме включаем минимальную скорость и запускаем ПИД */
+			if (regime_state == Regime::REGIME1)
+			{
+				/**
+				 * Насос раскручивается в фоне, давление продолжаем читать.
+				 * Если насос так и не подтвердил запуск (все попытки записи
+				 * провалились), запускаем заново, ПИД потом подхватит безударно.
+				 */
+				if (pump.get_state() == PumpStates::OFF || pump.is_state_lost())
+				{
+					pump.request_start(10);
+					is_pid_running = false;
+				}
+				else if (!pump.is_busy())
 				{
-					if (pump.get_state() == PumpStates::OFF)
+					/* Безударное переключение - ПИД продолжает с текущей скорости насоса */
+					if (!is_pid_running)
 					{
-						pump.set_speed(10);
-						vTaskDelay(1000 / 16);
-						pump.start();
+						pid.reset(pressure.get_target(), pressure.get_value(),
+								  pump.get_speed() * PRESSURE_ONE);
 					}
 
 					set_PID(pressure.get_value());
+					is_pid_running = true;
+				}
+			}
+			/* Во втором режиме просто шарашим на полную */
+			else if (regime_state == Regime::REGIME2)
+			{
+				if (pump.get_state() == PumpStates::OFF || pump.is_state_lost())
+				{
+					pump.request_start(pump_flushing_rpm);
 				}
-				/* Во втором режиме просто шарашим на полную */
-				else if (regime_state == Regime::REGIME2)
+				else if (!pump.is_busy())
 				{
 					pump.set_speed(pump_flushing_rpm);
-
-					_delay_ms(20);
-
-					if (pump.get_state() == PumpStates::OFF)
-					{
-						pump.start();
-					}
 				}
-				else if (regime_state == Regime::REGIME_REMOVE_BUBBLE) {
+			}
+			else if (regime_state == Regime::REGIME_REMOVE_BUBBLE) {
+				if (pump.get_state() == PumpStates::OFF || pump.is_state_lost()) {
+					pump.request_start(PUMP_MAX_SPEED);
+				}
+				else if (!pump.is_busy()) {
 					pump.set_speed(PUMP_MAX_SPEED);
-
-					if (pump.get_state() == PumpStates::OFF) {
-						pump.start();
-					}
 				}
-				else if (regime_state == Regime::STOPED)
+			}
+			else if (regime_state == Regime::STOPED)
+			{
+				/**
+				 * Останавливаем все установленные насосы, а не только насос выбранной почки.
+				 * Остановка перебивает ещё не законченный запуск, неподтверждённую повторяем.
+				 */
+				for (uint8_t i = 0; i < INSTALLED_PUMP_COUNT; ++i)
 				{
-					if (pump.get_state() == PumpStates::ON)
+					Pump &stopped_pump = *installed_pumps[i];
+
+					if ((stopped_pump.get_state() == PumpStates::ON || stopped_pump.is_busy() ||
+						 stopped_pump.is_state_lost()) && !stopped_pump.is_stopping())
 					{
-						pump.stop();
-						pump.set_speed(10);
-						// vTaskDelay(1000 / 16);
+						stopped_pump.request_stop(10);
 					}
 				}
 			}
 
-			/**
-			 * Обнуляем переменную, даже если не произвели вычисления,
-			 * иначе есть солидный шанс попасть в бесконечный цикл
-			 */
-			counter = 0;
+			if (regime_state != Regime::REGIME1)
+				is_pid_running = false;
 		}
-
-		vTaskDelay(PRESSURE_SENSOR_TICK_RATE / 16); // one tick delay (16ms) in between reads for stability
 	}
 }
 
@@ -789,10 +1741,99 @@ void task_pump_control(void *params)
 		// 	continue;
 		// }
 
-		peripheral_status.is_pump_online = pump.check_timeout();
+		if (is_emergency_stop_requested)
+		{
+			is_emergency_stop_requested = false;
+			emergency_stop_pumps();
+		}
+
+		peripheral_status.is_pump_online = are_pumps_online();
+
+		pump_bus.process();
+		left_pump.process();
 
-		pump.process();
-		vTaskDelay(3);
+		if (IS_RIGHT_PUMP_INSTALLED)
+			right_pump.process();
+
+		/* Sleep until the reply is received or the next command may be due */
+		ulTaskNotifyTake(pdTRUE, PUMP_CONTROL_TICK_RATE);
+	}
+}
+
+void task_telemetry(void *params)
+{
+	uint8_t status_frame_count = 0;
+
+	for (;;)
+	{
+		uint32_t events = 0;
+		xTaskNotifyWait(0, TELEMETRY_NOTIFY_SESSION_TICK | TELEMETRY_NOTIFY_STREAM | TELEMETRY_NOTIFY_CAPTURE,
+						&events, portMAX_DELAY);
+
+		/* The whole capture goes at once, about 0.25 s of the port */
+		if (events & TELEMETRY_NOTIFY_CAPTURE)
+		{
+			if (telemetry_mode == TELEMETRY_MODE_FRAMED || is_capture_dump_requested)
+				send_capture_frames();
+
+			is_capture_dump_requested = false;
+		}
+
+		TelemetrySnapshot snapshot;
+		if (!telemetry_snapshot.read(snapshot))
+			continue;
+
+		/* Stream frames go as soon as the control task has the points */
+		if (events & TELEMETRY_NOTIFY_STREAM)
+			send_stream_frames(snapshot);
+
+		/* One status frame per Timer5 tick */
+		if (!(events & TELEMETRY_NOTIFY_SESSION_TICK))
+			continue;
+
+		taskENTER_CRITICAL();
+		Time frame_time = telemetry_time;
+		taskEXIT_CRITICAL();
+
+		pack_status_payload(snapshot, frame_time, to_send);
+
+		if (telemetry_mode == TELEMETRY_MODE_LEGACY)
+		{
+			to_send[TO_SEND_ARRAY_SIZE - 1] = '\n';
+			send_telemetry(to_send, TO_SEND_ARRAY_SIZE);
+			continue;
+		}
+
+		uint8_t frame_size = telemetry_framer.build(TELEMETRY_FRAME_STATUS, to_send,
+													TELEMETRY_STATUS_PAYLOAD_SIZE, telemetry_frame);
+		send_telemetry(telemetry_frame, frame_size);
+
+		if (++status_frame_count < TELEMETRY_MODBUS_STATS_PERIOD)
+			continue;
+
+		status_frame_count = 0;
+
+		uint8_t payload[TELEMETRY_MAX_PAYLOAD];
+		uint8_t payload_size = pack_modbus_stats_payload(payload);
+
+		frame_size = telemetry_framer.build(TELEMETRY_FRAME_MODBUS_STATS, payload, payload_size, telemetry_frame);
+		send_telemetry(telemetry_frame, frame_size);
+	}
+}
+
+void task_scada_slave(void *params)
+{
+	Serial2.begin(SCADA_BAUD_RATE, SERIAL_8E1);
+	scada.begin(SCADA_BAUD_RATE);
+
+	for (;;)
+	{
+		uint8_t changed_mask = scada.poll();
+
+		if (changed_mask != 0)
+			apply_scada_setpoints(changed_mask);
+
+		vTaskDelay(1);
 	}
 }
 
@@ -809,16 +1850,14 @@ void task_CLI(void *params)
 			int size = Serial.readBytesUntil('\n', sym, 100);
 			sym[size] = '\0';
 
+			/* Ответ команды уходит целиком, между кадрами телеметрии */
+			xSemaphoreTake(serial_mutex, portMAX_DELAY);
 			parse_message(String(sym));
+			xSemaphoreGive(serial_mutex);
 
 			is_data_transmitted = false;
 		}
 
-		if (Serial3.available() >= 1)
-		{
-			Serial3.readBytes(pump.reply, Serial3.available());
-		}
-
 		vTaskDelay(5);
 	}
 }
@@ -860,6 +1899,9 @@ void task_handle_error(void *params)
 
 	bool is_pressure_high_beat = false;
 
+	/* Тревоги прошлого прохода, по новой запускается снимок давления */
+	uint8_t last_alerts = 0;
+
 	// Add 10 mins timer - if after 10 mins pressure doesn't fall, stop
 	// the system, if pressure fall below HIGH, stop the timer
 	Timer4.setFrequency(1);
@@ -868,6 +1910,23 @@ void task_handle_error(void *params)
 
 	for (;;)
 	{
+		/**
+		 * Команда насосу не прошла ни с одной попытки, насос уже помечен
+		 * неисправным (peripheral_status). Запуск и скорость выбранного
+		 * насоса задача управления повторит сама, а непрошедшую остановку
+		 * больше никто не повторит - повторяем её здесь
+		 */
+		for (uint8_t i = 0; i < INSTALLED_PUMP_COUNT; ++i)
+		{
+			Pump &failed_pump = *installed_pumps[i];
+
+			if (failed_pump.take_command_failure() && failed_pump.get_state() == PumpStates::OFF &&
+				!failed_pump.is_stopping())
+			{
+				failed_pump.request_stop(10);
+			}
+		}
+
 		if (is_system_blocked)
 		{
 			vTaskDelay(1000);
@@ -919,7 +1978,10 @@ void task_handle_error(void *params)
 
 			if (pressure.get_value() > pressure.get_high_limit())
 			{
-				pump.stop();
+				/* Давление общее, останавливаем все насосы */
+				for (uint8_t i = 0; i < INSTALLED_PUMP_COUNT; ++i)
+					installed_pumps[i]->stop();
+
 				// regime_state = Regime::STOPED;
 				alert[AlertType::PRESSURE_HIGH] = true;
 				alert[AlertType::PRESSURE_LOW] = false;
@@ -952,7 +2014,7 @@ void task_handle_error(void *params)
 				error_timer_secs = 0;
 
 				if (is_pressure_high_beat) {
-					pump.start();
+					selected_pump().start();
 					regime_state = Regime::REGIME1;
 					is_pressure_high_beat = false;
 				}
@@ -1012,6 +2074,27 @@ void task_handle_error(void *params)
 			alert[AlertType::NONE] = !is_error_occurred;
 		}
 
+		uint8_t alerts = pack_alerts();
+		uint8_t new_alerts = alerts & ~last_alerts;
+		last_alerts = alerts;
+
+		/**
+		 * Причина снимка - номер первой новой тревоги (AlertType).
+		 * Тревоги по давлению пропускаем, их снимок запускает задача
+		 * управления по усечённому среднему, без задержки сглаживания
+		 */
+		for (uint8_t i = 1; i < alert_size; ++i)
+		{
+			if (i == AlertType::PRESSURE_LOW || i == AlertType::PRESSURE_HIGH)
+				continue;
+
+			if (new_alerts & (1 << (i - 1)))
+			{
+				pressure_capture.trigger(i);
+				break;
+			}
+		}
+
 		vTaskDelay(1000 / 16);
 	}
 }
@@ -0,0 +1,378 @@
+#include "modbus_queue.h"
+#include <Arduino_FreeRTOS.h>
+
+ModbusQueue::ModbusQueue()
+{
+    for (uint8_t i = 0; i < CAPACITY; ++i)
+        slots[i].is_used = false;
+}
+
+/**
+ * The commands are pushed by the control, CLI and SCADA tasks while the bus
+ * task sends them, so every public method works on the slots inside a
+ * critical section. The callbacks are called outside of it.
+ */
+bool ModbusQueue::push(const ModbusTransaction &transaction)
+{
+    if (transaction.telegram.u16CoilsNo > MODBUS_MAX_PAYLOAD)
+    {
+        taskENTER_CRITICAL();
+        ++dropped_count;
+        taskEXIT_CRITICAL();
+        return false;
+    }
+
+    taskENTER_CRITICAL();
+    bool is_pushed = push_slot(transaction);
+    taskEXIT_CRITICAL();
+
+    return is_pushed;
+}
+
+bool ModbusQueue::push_slot(const ModbusTransaction &transaction)
+{
+    int8_t idx = -1;
+    bool is_coalesced = false;
+
+    if (transaction.is_latest_wins)
+    {
+        idx = find_tag(transaction.tag);
+        is_coalesced = (idx >= 0);
+
+        if (is_coalesced)
+            ++coalesced_count;
+    }
+
+    if (idx < 0)
+    {
+        for (uint8_t i = 0; i < CAPACITY; ++i)
+        {
+            if (!slots[i].is_used)
+            {
+                idx = i;
+                break;
+            }
+        }
+    }
+
+    if (idx < 0)
+    {
+        ++dropped_count;
+        return false;
+    }
+
+    slots[idx].transaction = transaction;
+    slots[idx].sequence = next_sequence++;
+    slots[idx].is_used = true;
+
+    /**
+     * A new value for a failing register takes over the attempts and the
+     * backoff of the old one, so frequent updates can't bypass the backoff
+     */
+    if (!is_coalesced)
+    {
+        slots[idx].attempt = 0;
+        slots[idx].not_before_ms = millis();
+
+        /* The same register is being written now, the same goes for it */
+        if (transaction.is_latest_wins && is_in_flight && in_flight.transaction.tag == transaction.tag)
+        {
+            slots[idx].attempt = in_flight.attempt;
+            slots[idx].not_before_ms = in_flight.not_before_ms;
+        }
+    }
+
+    return true;
+}
+
+bool ModbusQueue::cancel(const uint8_t &tag)
+{
+    taskENTER_CRITICAL();
+
+    int8_t idx = find_tag(tag);
+
+    if (idx >= 0)
+        slots[idx].is_used = false;
+
+    taskEXIT_CRITICAL();
+
+    return idx >= 0;
+}
+
+bool ModbusQueue::contains(const uint8_t &tag)
+{
+    taskENTER_CRITICAL();
+    bool is_found = find_tag(tag) >= 0;
+    taskEXIT_CRITICAL();
+
+    return is_found;
+}
+
+bool ModbusQueue::is_sending(const uint8_t &tag)
+{
+    taskENTER_CRITICAL();
+    bool is_sent = is_in_flight && in_flight.transaction.tag == tag;
+    taskEXIT_CRITICAL();
+
+    return is_sent;
+}
+
+void ModbusQueue::clear()
+{
+    taskENTER_CRITICAL();
+
+    for (uint8_t i = 0; i < CAPACITY; ++i)
+        slots[i].is_used = false;
+
+    taskEXIT_CRITICAL();
+}
+
+bool ModbusQueue::peek(ModbusPriority &priority)
+{
+    taskENTER_CRITICAL();
+
+    int8_t idx = is_in_flight ? -1 : find_next();
+
+    if (idx >= 0)
+        priority = slots[idx].transaction.priority;
+
+    taskEXIT_CRITICAL();
+
+    return idx >= 0;
+}
+
+const ModbusTransaction *ModbusQueue::begin_send()
+{
+    taskENTER_CRITICAL();
+
+    int8_t idx = is_in_flight ? -1 : find_next();
+
+    if (idx < 0)
+    {
+        taskEXIT_CRITICAL();
+        return NULL;
+    }
+
+    /**
+     * The master keeps the pointer to the registers until the reply,
+     * so it must point to the copy that lives while the transaction is in flight
+     */
+    in_flight = slots[idx];
+    in_flight.transaction.telegram.au16reg = in_flight.transaction.payload;
+    ++in_flight.attempt;
+
+    slots[idx].is_used = false;
+    is_in_flight = true;
+
+    taskEXIT_CRITICAL();
+
+    return &in_flight.transaction;
+}
+
+void ModbusQueue::end_send(const uint8_t &result)
+{
+    taskENTER_CRITICAL();
+
+    if (!is_in_flight)
+    {
+        taskEXIT_CRITICAL();
+        return;
+    }
+
+    is_in_flight = false;
+
+    if (result != 0 && schedule_retry())
+    {
+        ++retry_count;
+        taskEXIT_CRITICAL();
+        return;
+    }
+
+    if (result != 0)
+        ++failed_count;
+
+    /* The register is reachable, a newer value for it starts the attempts over */
+    if (result == 0 && in_flight.transaction.is_latest_wins)
+    {
+        int8_t idx = find_tag(in_flight.transaction.tag);
+
+        if (idx >= 0)
+            slots[idx].attempt = 0;
+    }
+
+    taskEXIT_CRITICAL();
+
+    /**
+     * in_flight is only changed by begin_send(), and it is called by the
+     * bus task after this one, so it is safe to read without the lock
+     */
+    ModbusTransaction &transaction = in_flight.transaction;
+
+    if (transaction.callback)
+        transaction.callback(transaction, result, transaction.context);
+}
+
+/**
+ * Puts the failed in_flight transaction back to the queue.
+ * Returns false if it has to be reported as failed instead.
+ */
+bool ModbusQueue::schedule_retry()
+{
+    const ModbusTransaction &transaction = in_flight.transaction;
+
+    bool is_exhausted = in_flight.attempt >= transaction.retry.max_attempts;
+
+    uint8_t shift = in_flight.attempt - 1;
+    if (shift > 15)
+        shift = 15;
+
+    uint32_t not_before_ms = millis() + ((uint32_t)transaction.retry.backoff_ms << shift);
+
+    /**
+     * A newer value has been pushed meanwhile, it is sent instead after the
+     * backoff. If this one has run out of attempts, it is still reported as
+     * failed, the newer one goes on with the attempts it has inherited.
+     */
+    if (transaction.is_latest_wins)
+    {
+        int8_t idx = find_tag(transaction.tag);
+
+        if (idx >= 0)
+        {
+            slots[idx].attempt = in_flight.attempt;
+            slots[idx].not_before_ms = not_before_ms;
+            return !is_exhausted;
+        }
+    }
+
+    if (is_exhausted)
+        return false;
+
+    for (uint8_t i = 0; i < CAPACITY; ++i)
+    {
+        if (slots[i].is_used)
+            continue;
+
+        /* The old sequence number keeps it in front of newer transactions */
+        slots[i] = in_flight;
+        slots[i].not_before_ms = not_before_ms;
+
+        return true;
+    }
+
+    return false;
+}
+
+uint8_t ModbusQueue::size()
+{
+    taskENTER_CRITICAL();
+    uint8_t count = count_used();
+    taskEXIT_CRITICAL();
+
+    return count;
+}
+
+bool ModbusQueue::is_idle()
+{
+    taskENTER_CRITICAL();
+    bool is_empty = !is_in_flight && count_used() == 0;
+    taskEXIT_CRITICAL();
+
+    return is_empty;
+}
+
+/* The counters are 16 bit, an AVR reads them in two instructions */
+uint16_t ModbusQueue::get_dropped_count()
+{
+    taskENTER_CRITICAL();
+    uint16_t count = dropped_count;
+    taskEXIT_CRITICAL();
+
+    return count;
+}
+
+uint16_t ModbusQueue::get_coalesced_count()
+{
+    taskENTER_CRITICAL();
+    uint16_t count = coalesced_count;
+    taskEXIT_CRITICAL();
+
+    return count;
+}
+
+uint16_t ModbusQueue::get_retry_count()
+{
+    taskENTER_CRITICAL();
+    uint16_t count = retry_count;
+    taskEXIT_CRITICAL();
+
+    return count;
+}
+
+uint16_t ModbusQueue::get_failed_count()
+{
+    taskENTER_CRITICAL();
+    uint16_t count = failed_count;
+    taskEXIT_CRITICAL();
+
+    return count;
+}
+
+uint8_t ModbusQueue::count_used()
+{
+    uint8_t count = 0;
+
+    for (uint8_t i = 0; i < CAPACITY; ++i)
+    {
+        if (slots[i].is_used)
+            ++count;
+    }
+
+    return count;
+}
+
+int8_t ModbusQueue::find_tag(const uint8_t &tag)
+{
+    for (uint8_t i = 0; i < CAPACITY; ++i)
+    {
+        if (slots[i].is_used && slots[i].transaction.tag == tag)
+            return i;
+    }
+
+    return -1;
+}
+
+int8_t ModbusQueue::find_next()
+{
+    int8_t best = -1;
+    uint32_t now = millis();
+
+    for (uint8_t i = 0; i < CAPACITY; ++i)
+    {
+        if (!slots[i].is_used)
+            continue;
+
+        /* Waiting for the backoff after a failed attempt */
+        if ((int32_t)(now - slots[i].not_before_ms) < 0)
+            continue;
+
+        if (best < 0)
+        {
+            best = i;
+            continue;
+        }
+
+        const Slot &candidate = slots[i];
+        const Slot &current = slots[best];
+
+        /* Sequence numbers wrap, compare the distance instead of the values */
+        if (candidate.transaction.priority < current.transaction.priority ||
+            (candidate.transaction.priority == current.transaction.priority &&
+             (int16_t)(candidate.sequence - current.sequence) < 0))
+        {
+            best = i;
+        }
+    }
+
+    return best;
+}
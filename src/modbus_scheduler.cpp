@@ -0,0 +1,202 @@
+#include "modbus_scheduler.h"
+#include <Arduino_FreeRTOS.h>
+
+ModbusScheduler::ModbusScheduler(Modbus &master)
+    : master(master)
+{
+}
+
+bool ModbusScheduler::add_slave(ModbusQueue &queue, const ModbusRateBudget &budget)
+{
+    if (lane_count >= MAX_SLAVES)
+        return false;
+
+    Lane &lane = lanes[lane_count++];
+    lane.queue = &queue;
+    lane.budget = budget;
+
+    if (lane.budget.burst == 0)
+        lane.budget.burst = 1;
+
+    lane.tokens = lane.budget.burst;
+    lane.last_refill_ms = millis();
+
+    return true;
+}
+
+void ModbusScheduler::broadcast(const uint8_t *frame, const uint8_t &size)
+{
+    broadcast_size = size;
+    broadcast_frame = frame;
+}
+
+void ModbusScheduler::process()
+{
+    if (is_reset_requested)
+    {
+        master.resetStats();
+        is_reset_requested = false;
+    }
+
+    if (in_flight_lane >= 0)
+    {
+        master.poll();
+
+        /* Still waiting for the reply */
+        if (master.getState() != COM_IDLE)
+            return;
+
+        /* The queue retries it or calls back, it may push the next one from the callback */
+        lanes[in_flight_lane].queue->end_send(master.getLastError());
+        in_flight_lane = -1;
+    }
+
+    if (broadcast_frame != NULL)
+    {
+        taskENTER_CRITICAL();
+        const uint8_t *frame = broadcast_frame;
+        uint8_t size = broadcast_size;
+        broadcast_frame = NULL;
+        taskEXIT_CRITICAL();
+
+        if (master.queryFrame_P(frame, size) == 0)
+        {
+            ++broadcast_count;
+            broadcast_sent_ms = millis();
+            is_turnaround = true;
+        }
+    }
+
+    if (is_turnaround)
+    {
+        if (millis() - broadcast_sent_ms < MODBUS_BROADCAST_TURNAROUND_MS)
+            return;
+
+        is_turnaround = false;
+    }
+
+    int8_t idx = find_next();
+
+    if (idx < 0)
+        return;
+
+    Lane &lane = lanes[idx];
+    const ModbusTransaction *transaction = lane.queue->begin_send();
+
+    if (transaction == NULL)
+        return;
+
+    if (transaction->priority != MODBUS_PRIORITY_HIGH && lane.budget.max_per_second != 0)
+        --lane.tokens;
+
+    last_lane = idx;
+
+    if (transaction->retry.timeout_ms != 0)
+        master.setTimeOut(transaction->retry.timeout_ms);
+
+    int8_t query_result = (transaction->frame != NULL) ?
+                              master.queryFrame_P(transaction->frame, transaction->frame_size) :
+                              master.query(transaction->telegram);
+
+    /* The master is idle here, so only an invalid telegram gets here - a failed attempt */
+    if (query_result != 0)
+    {
+        lane.queue->end_send((uint8_t)query_result);
+        return;
+    }
+
+    in_flight_lane = idx;
+}
+
+void ModbusScheduler::refill(Lane &lane, const uint32_t &now)
+{
+    if (lane.budget.max_per_second == 0)
+        return;
+
+    uint16_t period_ms = 1000 / lane.budget.max_per_second;
+    uint32_t elapsed_ms = now - lane.last_refill_ms;
+
+    if (elapsed_ms < period_ms)
+        return;
+
+    uint32_t new_tokens = elapsed_ms / period_ms;
+    lane.last_refill_ms += new_tokens * period_ms;
+
+    if (lane.tokens + new_tokens >= lane.budget.burst)
+    {
+        lane.tokens = lane.budget.burst;
+        lane.last_refill_ms = now;
+    }
+    else
+        lane.tokens += new_tokens;
+}
+
+int8_t ModbusScheduler::find_next()
+{
+    int8_t best = -1;
+    ModbusPriority best_priority = MODBUS_PRIORITY_IDLE;
+    uint32_t now = millis();
+
+    for (uint8_t i = 1; i <= lane_count; ++i)
+    {
+        uint8_t idx = (last_lane + i) % lane_count;
+        Lane &lane = lanes[idx];
+
+        ModbusPriority priority;
+
+        if (!lane.queue->peek(priority))
+            continue;
+
+        refill(lane, now);
+
+        if (priority != MODBUS_PRIORITY_HIGH && lane.budget.max_per_second != 0 && lane.tokens == 0)
+        {
+            ++throttled_count;
+            continue;
+        }
+
+        /* Strictly higher only, so the first one in the round robin order wins a tie */
+        if (best < 0 || priority < best_priority)
+        {
+            best = idx;
+            best_priority = priority;
+        }
+    }
+
+    return best;
+}
+
+bool ModbusScheduler::is_idle()
+{
+    if (in_flight_lane >= 0 || broadcast_frame != NULL || is_turnaround)
+        return false;
+
+    for (uint8_t i = 0; i < lane_count; ++i)
+    {
+        if (!lanes[i].queue->is_idle())
+            return false;
+    }
+
+    return true;
+}
+
+Modbus &ModbusScheduler::get_master()
+{
+    return master;
+}
+
+uint16_t ModbusScheduler::get_throttled_count()
+{
+    return throttled_count;
+}
+
+uint16_t ModbusScheduler::get_broadcast_count()
+{
+    return broadcast_count;
+}
+
+void ModbusScheduler::reset_stats()
+{
+    /* Applied by the pump task itself at the next process() */
+    is_reset_requested = true;
+}
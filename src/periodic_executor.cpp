@@ -0,0 +1,98 @@
+#include "periodic_executor.h"
+
+PeriodicExecutor::PeriodicExecutor(const TickType_t& period_ticks)
+    : period_ticks(period_ticks)
+{
+}
+
+void PeriodicExecutor::wait_next_cycle()
+{
+    uint32_t now_us = micros();
+
+    if (is_reset_requested) {
+        cycle_count = period_count = overrun_count = 0;
+        total_exec_us = 0;
+        total_jitter_us = 0;
+        is_reset_requested = false;
+    }
+    else if (is_started) {
+        uint32_t exec_us = now_us - cycle_start_us;
+
+        if (cycle_count == 0 || exec_us < min_exec_us)
+            min_exec_us = exec_us;
+        if (cycle_count == 0 || exec_us > max_exec_us)
+            max_exec_us = exec_us;
+
+        total_exec_us += exec_us;
+        ++cycle_count;
+    }
+
+    if (!is_started) {
+        last_wake_ticks = xTaskGetTickCount();
+    }
+
+    /* The deadline has already passed - don't try to catch up */
+    if ((TickType_t)(xTaskGetTickCount() - last_wake_ticks) >= period_ticks) {
+        ++overrun_count;
+        last_wake_ticks = xTaskGetTickCount();
+    }
+    else {
+        vTaskDelayUntil(&last_wake_ticks, period_ticks);
+    }
+
+    uint32_t start_us = micros();
+
+    if (is_started) {
+        int32_t jitter_us = (int32_t)(start_us - cycle_start_us) - (int32_t)(get_period_ms() * 1000);
+
+        if (period_count == 0 || jitter_us < min_jitter_us)
+            min_jitter_us = jitter_us;
+        if (period_count == 0 || jitter_us > max_jitter_us)
+            max_jitter_us = jitter_us;
+
+        total_jitter_us += jitter_us;
+        ++period_count;
+    }
+
+    cycle_start_us = start_us;
+    is_started = true;
+}
+
+TickType_t PeriodicExecutor::get_period_ticks() const
+{
+    return period_ticks;
+}
+
+uint32_t PeriodicExecutor::get_period_ms() const
+{
+    return (uint32_t)period_ticks * portTICK_PERIOD_MS;
+}
+
+PeriodicExecutor::Stats PeriodicExecutor::get_stats()
+{
+    Stats stats;
+
+    taskENTER_CRITICAL();
+    stats.cycle_count = cycle_count;
+    stats.overrun_count = overrun_count;
+    stats.min_exec_us = min_exec_us;
+    stats.max_exec_us = max_exec_us;
+    uint64_t total_exec = total_exec_us;
+    stats.min_jitter_us = min_jitter_us;
+    stats.max_jitter_us = max_jitter_us;
+    int64_t total_jitter = total_jitter_us;
+    uint32_t periods = period_count;
+    taskEXIT_CRITICAL();
+
+    stats.period_us = get_period_ms() * 1000;
+    stats.mean_exec_us = stats.cycle_count ? total_exec / stats.cycle_count : 0;
+    stats.mean_jitter_us = periods ? total_jitter / (int32_t)periods : 0;
+
+    return stats;
+}
+
+void PeriodicExecutor::reset_stats()
+{
+    /* Applied by the executor task itself at the end of the next cycle */
+    is_reset_requested = true;
+}
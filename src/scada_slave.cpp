@@ -0,0 +1,86 @@
+#include "scada_slave.h"
+
+/* RS-232 or an RS-485 adapter with automatic direction, no TX enable pin */
+ScadaSlave::ScadaSlave(Stream &port, const uint8_t &id)
+    : slave(id, port, 0)
+{
+    memset(registers, 0, sizeof(registers));
+}
+
+void ScadaSlave::begin(const uint32_t &baud_rate)
+{
+    slave.setBaudRate(baud_rate);
+    slave.setFirstWritable(SCADA_FIRST_SETPOINT);
+    slave.setWriteCheck(check_setpoints, this);
+    slave.start();
+}
+
+void ScadaSlave::publish(const int16_t *registers)
+{
+    taskENTER_CRITICAL();
+    memcpy(snapshot, registers, sizeof(snapshot));
+    is_snapshot_new = true;
+    taskEXIT_CRITICAL();
+}
+
+uint8_t ScadaSlave::poll()
+{
+    if (is_snapshot_new)
+    {
+        taskENTER_CRITICAL();
+        memcpy(registers, snapshot, sizeof(registers));
+        is_snapshot_new = false;
+        taskEXIT_CRITICAL();
+    }
+
+    uint16_t setpoints[SCADA_SETPOINT_COUNT];
+    memcpy(setpoints, &registers[SCADA_FIRST_SETPOINT], sizeof(setpoints));
+
+    /**
+     * Writes to the read only block are refused with ILLEGAL DATA ADDRESS,
+     * setpoints out of range with ILLEGAL DATA VALUE
+     */
+    if (slave.poll(registers, SCADA_REGISTER_COUNT) <= 4)
+        return 0;
+
+    uint8_t changed_mask = 0;
+
+    for (uint8_t i = 0; i < SCADA_SETPOINT_COUNT; ++i)
+    {
+        if (registers[SCADA_FIRST_SETPOINT + i] != setpoints[i])
+            changed_mask |= 1 << i;
+    }
+
+    return changed_mask;
+}
+
+int16_t ScadaSlave::get_register(const uint8_t &address)
+{
+    return registers[address];
+}
+
+boolean ScadaSlave::check_setpoints(uint16_t start, uint16_t count, const uint16_t *values, void *context)
+{
+    ScadaSlave *scada = (ScadaSlave *)context;
+
+    int16_t setpoints[SCADA_SETPOINT_COUNT];
+    memcpy(setpoints, &scada->registers[SCADA_FIRST_SETPOINT], sizeof(setpoints));
+
+    /* The slave has checked the addresses already, start is a setpoint. Only the written ones are checked */
+    for (uint16_t i = 0; i < count; ++i)
+    {
+        uint8_t setpoint = start + i - SCADA_FIRST_SETPOINT;
+        int16_t value = values[i];
+
+        if (value < SCADA_SETPOINT_RANGES[setpoint].min || value > SCADA_SETPOINT_RANGES[setpoint].max)
+            return false;
+
+        setpoints[setpoint] = value;
+    }
+
+    uint8_t low = SCADA_TEMP_LOW_LIMIT - SCADA_FIRST_SETPOINT;
+    uint8_t high = SCADA_TEMP_HIGH_LIMIT - SCADA_FIRST_SETPOINT;
+    bool is_temperature_written = start <= SCADA_TEMP_HIGH_LIMIT && start + count > SCADA_TEMP_LOW_LIMIT;
+
+    return !is_temperature_written || setpoints[low] < setpoints[high];
+}
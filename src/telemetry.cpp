@@ -0,0 +1,349 @@
+#include "telemetry.h"
+#include <string.h>
+
+static const char *const FIELD_NAMES[TELEMETRY_FIELD_COUNT] = {
+    "pressure",
+    "pressure_mean",
+    "flow",
+    "temp1",
+    "temp2",
+    "target",
+    "state"
+};
+
+const char *telemetry_field_name(const uint8_t &field)
+{
+    return (field < TELEMETRY_FIELD_COUNT) ? FIELD_NAMES[field] : "";
+}
+
+bool telemetry_field_from_name(const char *name, TelemetryField &field)
+{
+    for (uint8_t i = 0; i < TELEMETRY_FIELD_COUNT; ++i)
+    {
+        if (strcmp(name, FIELD_NAMES[i]) == 0)
+        {
+            field = (TelemetryField)i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+uint8_t cobs_encode(const uint8_t *data, const uint8_t &size, uint8_t *encoded)
+{
+    /* Every block starts with the distance to the next zero */
+    uint8_t code_idx = 0;
+    uint8_t code = 1;
+    uint8_t out_idx = 1;
+
+    for (uint8_t i = 0; i < size; ++i)
+    {
+        if (data[i] != 0)
+        {
+            encoded[out_idx++] = data[i];
+            ++code;
+        }
+
+        /* A zero ends the block, a full block ends without one */
+        if (data[i] == 0 || code == 0xFF)
+        {
+            encoded[code_idx] = code;
+            code_idx = out_idx++;
+            code = 1;
+        }
+    }
+
+    encoded[code_idx] = code;
+    return out_idx;
+}
+
+uint8_t TelemetryFramer::build(const TelemetryFrameType &type, const uint8_t *payload, const uint8_t &size, uint8_t *frame)
+{
+    if (size > TELEMETRY_MAX_PAYLOAD)
+        return 0;
+
+    uint8_t raw[TELEMETRY_HEADER_SIZE + TELEMETRY_MAX_PAYLOAD + 2];
+    uint8_t raw_size = 0;
+
+    raw[raw_size++] = TELEMETRY_PROTOCOL_VERSION;
+    raw[raw_size++] = type;
+    raw[raw_size++] = sequence++;
+
+    memcpy(&raw[raw_size], payload, size);
+    raw_size += size;
+
+    uint16_t crc = crc16(raw, raw_size);
+    raw[raw_size++] = crc & 0xFF;
+    raw[raw_size++] = crc >> 8;
+
+    uint8_t frame_size = cobs_encode(raw, raw_size, frame);
+    frame[frame_size++] = 0;
+
+    return frame_size;
+}
+
+uint8_t TelemetryFramer::get_sequence() const
+{
+    return sequence;
+}
+
+bool TelemetryStreamClock::advance(const uint32_t &timestamp_us, uint16_t &slot)
+{
+    if (!is_started)
+    {
+        is_started = true;
+        next_slot_us = timestamp_us + TELEMETRY_STREAM_SLOT_US;
+        slot = current_slot;
+        return true;
+    }
+
+    /* Signed difference, so micros() overflow doesn't matter */
+    int32_t late_us = (int32_t)(timestamp_us - next_slot_us);
+
+    if (late_us < 0)
+        return false;
+
+    /* The slots without samples are skipped, their numbers too */
+    uint32_t slot_count = (uint32_t)late_us / TELEMETRY_STREAM_SLOT_US + 1;
+    current_slot += slot_count;
+    next_slot_us += slot_count * TELEMETRY_STREAM_SLOT_US;
+
+    slot = current_slot;
+    return true;
+}
+
+void TelemetryDecimator::set_ratio(const TelemetryField &field, const uint8_t &ratio)
+{
+    ratios[field] = ratio;
+}
+
+uint8_t TelemetryDecimator::get_ratio(const TelemetryField &field) const
+{
+    return ratios[field];
+}
+
+bool TelemetryDecimator::is_enabled() const
+{
+    return get_enabled_mask() != 0;
+}
+
+uint8_t TelemetryDecimator::get_enabled_mask() const
+{
+    uint8_t mask = 0;
+
+    for (uint8_t i = 0; i < TELEMETRY_FIELD_COUNT; ++i)
+    {
+        if (ratios[i] != 0)
+            mask |= 1 << i;
+    }
+
+    return mask;
+}
+
+uint8_t TelemetryDecimator::get_due_mask(const uint16_t &slot) const
+{
+    uint8_t mask = 0;
+
+    for (uint8_t i = 0; i < TELEMETRY_FIELD_COUNT; ++i)
+    {
+        uint8_t ratio = ratios[i];
+
+        if (ratio != 0 && slot % ratio == 0)
+            mask |= 1 << i;
+    }
+
+    return mask;
+}
+
+uint16_t TelemetryDecimator::get_bytes_per_second() const
+{
+    uint16_t bytes = 0;
+
+    /* One second of slots, a ratio that doesn't divide the rate is off by a frame */
+    for (uint8_t slot = 0; slot < TELEMETRY_STREAM_RATE_HZ; ++slot)
+    {
+        uint8_t mask = get_due_mask(slot);
+
+        if (mask == 0)
+            continue;
+
+        bytes += TELEMETRY_FRAME_OVERHEAD + TELEMETRY_STREAM_HEADER_SIZE;
+
+        for (uint8_t i = 0; i < TELEMETRY_FIELD_COUNT; ++i)
+        {
+            if (mask & (1 << i))
+                bytes += telemetry_field_size(i);
+        }
+    }
+
+    return bytes;
+}
+
+uint8_t varint_encode(uint32_t value, uint8_t *encoded)
+{
+    uint8_t size = 0;
+
+    while (value >= 0x80)
+    {
+        encoded[size++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+
+    encoded[size++] = value;
+    return size;
+}
+
+void TelemetryDeltaEncoder::set_key_interval(const uint8_t &interval)
+{
+    key_interval = interval;
+
+    /* The next frame is a keyframe */
+    has_key = false;
+}
+
+uint8_t TelemetryDeltaEncoder::get_key_interval() const
+{
+    return key_interval;
+}
+
+bool TelemetryDeltaEncoder::add(const uint16_t &slot, const uint8_t &mask, const uint8_t &streamed_mask,
+                                const int32_t *values, const uint8_t &sequence)
+{
+    /* A keyframe holds one slot */
+    if (payload_size != 0 && payload_type == TELEMETRY_FRAME_STREAM_KEY)
+        return false;
+
+    /* A field enabled after the keyframe has nothing to refer to */
+    bool is_key = !has_key || frames_since_key + 1 >= key_interval || (mask & ~key_mask) != 0;
+
+    if (!is_key)
+    {
+        /* The first slot of a frame refers to the keyframe, the next ones to the slots before them */
+        if (payload_size == 0)
+        {
+            reference_slot = key_slot;
+            memcpy(reference_values, key_values, sizeof(reference_values));
+        }
+
+        /* The worst case is bigger than a payload */
+        uint8_t encoded[3 + 1 + (TELEMETRY_FIELD_COUNT - 1) * TELEMETRY_VARINT_MAX_SIZE + 3];
+        uint8_t encoded_size = pack_delta(slot, mask, values, encoded);
+
+        uint8_t header_size = (payload_size == 0) ? 1 : 0;
+
+        if (payload_size + header_size + encoded_size <= TELEMETRY_MAX_PAYLOAD)
+        {
+            if (header_size != 0)
+            {
+                payload[payload_size++] = key_sequence;
+                payload_type = TELEMETRY_FRAME_STREAM_DELTA;
+            }
+
+            memcpy(&payload[payload_size], encoded, encoded_size);
+            payload_size += encoded_size;
+
+            reference_slot = slot;
+            for (uint8_t i = 0; i < TELEMETRY_FIELD_COUNT; ++i)
+            {
+                if (mask & (1 << i))
+                    reference_values[i] = values[i];
+            }
+
+            return true;
+        }
+
+        /* Goes in the next frame */
+        if (payload_size != 0)
+            return false;
+
+        /* Doesn't fit even alone, the values have gone too far from the keyframe */
+    }
+
+    /* The deltas of the old keyframe go first */
+    if (payload_size != 0)
+        return false;
+
+    add_key(slot, mask | streamed_mask, values, sequence);
+    return true;
+}
+
+bool TelemetryDeltaEncoder::is_empty() const
+{
+    return payload_size == 0;
+}
+
+const uint8_t *TelemetryDeltaEncoder::finish(TelemetryFrameType &type, uint8_t &size)
+{
+    if (payload_type == TELEMETRY_FRAME_STREAM_DELTA && payload_size != 0)
+        ++frames_since_key;
+
+    type = payload_type;
+    size = payload_size;
+    payload_size = 0;
+
+    return payload;
+}
+
+void TelemetryDeltaEncoder::add_key(const uint16_t &slot, const uint8_t &mask, const int32_t *values, const uint8_t &sequence)
+{
+    key_sequence = sequence;
+    key_slot = slot;
+    key_mask = mask;
+    memcpy(key_values, values, sizeof(key_values));
+
+    frames_since_key = 0;
+    has_key = true;
+
+    payload_type = TELEMETRY_FRAME_STREAM_KEY;
+    payload_size = 0;
+
+    memcpy(&payload[payload_size], &slot, 2);
+    payload_size += 2;
+    payload[payload_size++] = mask;
+
+    for (uint8_t i = 0; i < TELEMETRY_FIELD_COUNT; ++i)
+    {
+        if (!(mask & (1 << i)))
+            continue;
+
+        memcpy(&payload[payload_size], &values[i], telemetry_field_size(i));
+        payload_size += telemetry_field_size(i);
+    }
+}
+
+uint8_t TelemetryDeltaEncoder::pack_delta(const uint16_t &slot, const uint8_t &mask, const int32_t *values, uint8_t *encoded)
+{
+    uint16_t offset = slot - reference_slot;
+    uint8_t size = 0;
+
+    /* The slot right after the reference is the usual case, it takes no offset */
+    if (offset == 1)
+    {
+        encoded[size++] = mask | TELEMETRY_DELTA_NEXT_SLOT;
+    }
+    else
+    {
+        encoded[size++] = mask;
+        size += varint_encode(offset, &encoded[size]);
+    }
+
+    for (uint8_t i = 0; i < TELEMETRY_FIELD_COUNT; ++i)
+    {
+        if (!(mask & (1 << i)))
+            continue;
+
+        if (i == TELEMETRY_FIELD_STATE)
+        {
+            memcpy(&encoded[size], &values[i], 3);
+            size += 3;
+            continue;
+        }
+
+        /* Wraps around, the host adds it back the same way */
+        int32_t delta = (int32_t)((uint32_t)values[i] - (uint32_t)reference_values[i]);
+        size += varint_encode(zigzag_encode(delta), &encoded[size]);
+    }
+
+    return size;
+}
@@ -0,0 +1,111 @@
+/**
+ * CPU cycles per pressure sample on the board: the fixed point pipeline
+ * of task_pressure_sensor_read against the same pipeline on float.
+ * Cycles are counted with Timer1 at F_CPU, as in the crc_benchmark sketch.
+ *
+ * pio test -e megaatmega2560 -f embedded/test_pressure_benchmark
+ */
+#include <Arduino.h>
+#include <unity.h>
+
+#include "BaseParams/Pressure.h"
+#include "trimmed_mean_filter.h"
+#include "exponential_smoother.h"
+
+/* PRESSURE_SMOOTHING_K, the window and the trim of main.cpp */
+const uint16_t SMOOTHING_K = 55;
+const uint8_t FILTER_WINDOW = 10;
+const uint8_t FILTER_TRIM_PERCENT = 20;
+
+const uint16_t SAMPLE_COUNT = 500;
+
+/* Every result is stored here, so the compiler can't drop a push as unused */
+volatile int32_t fixed_sink;
+volatile float float_sink;
+
+int16_t trace[SAMPLE_COUNT];
+
+/* A noisy wave around 30 units, 0.3125 units per count */
+static void make_trace() {
+    randomSeed(1);
+
+    for (uint16_t i = 0; i < SAMPLE_COUNT; ++i)
+        trace[i] = 96 + (int16_t)(25 * sin(i * 0.02)) + random(-3, 4);
+}
+
+static void start_cycles() {
+    noInterrupts();
+    TCCR1A = 0;
+    TCCR1B = _BV(CS10); // no prescaler, one count per CPU cycle
+    TCNT1 = 0;
+}
+
+static uint16_t stop_cycles() {
+    uint16_t cycles = TCNT1;
+    interrupts();
+    return cycles;
+}
+
+static uint32_t fixed_cycles_per_sample() {
+    TrimmedMeanFilter<pressure_t, int32_t, 32> filter(FILTER_WINDOW, FILTER_TRIM_PERCENT);
+    ExponentialSmoother<pressure_t> smoother(SMOOTHING_K);
+    pressure_t tare = pressure_from_float(1.5);
+    smoother.reset(pressure_from_int(30));
+
+    uint32_t total = 0;
+
+    for (uint16_t i = 0; i < SAMPLE_COUNT; ++i) {
+        start_cycles();
+        fixed_sink = smoother.push(filter.push(pressure_from_raw(trace[i]) - tare));
+        total += stop_cycles();
+    }
+
+    return total / SAMPLE_COUNT;
+}
+
+static uint32_t float_cycles_per_sample() {
+    TrimmedMeanFilter<float, float, 32> filter(FILTER_WINDOW, FILTER_TRIM_PERCENT);
+    float smoothed = 30;
+
+    uint32_t total = 0;
+
+    for (uint16_t i = 0; i < SAMPLE_COUNT; ++i) {
+        start_cycles();
+        smoothed += (filter.push(trace[i] * 0.3125f - 1.5f) - smoothed) * (SMOOTHING_K / 65536.0f);
+        float_sink = smoothed;
+        total += stop_cycles();
+    }
+
+    return total / SAMPLE_COUNT;
+}
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+/* The point of the fixed point rework: a sample must cost fewer cycles than on float */
+void test_cycles_per_sample(void) {
+    make_trace();
+
+    uint32_t fixed_cycles = fixed_cycles_per_sample();
+    uint32_t float_cycles = float_cycles_per_sample();
+
+    char message[80];
+    snprintf(message, sizeof(message), "cycles per sample: fixed point %lu, float %lu",
+             (unsigned long)fixed_cycles, (unsigned long)float_cycles);
+    TEST_MESSAGE(message);
+
+    TEST_ASSERT_LESS_THAN_UINT32(float_cycles, fixed_cycles);
+}
+
+void setup() {
+    /* The board resets when the port opens, give the host time to connect */
+    delay(2000);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_cycles_per_sample);
+    UNITY_END();
+}
+
+void loop() {
+}
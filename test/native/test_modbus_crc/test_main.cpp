@@ -0,0 +1,159 @@
+/**
+ * CRC16/MODBUS: every variant against known frames and against each other.
+ *
+ * pio test -e native -f native/test_modbus_crc
+ */
+#include <unity.h>
+
+#include <chrono>
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "ModbusCrc.h"
+#include "ModbusCrc.cpp"
+
+typedef uint16_t (*crc_function)(const uint8_t *, uint16_t);
+
+const crc_function VARIANTS[] = {crc16Bitwise, crc16Nibble, crc16Table, crc16};
+const char *const VARIANT_NAMES[] = {"bitwise", "nibble table", "byte table", "crc16"};
+const uint8_t VARIANT_COUNT = sizeof(VARIANTS) / sizeof(VARIANTS[0]);
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+/* The check value of CRC-16/MODBUS */
+void test_check_value(void) {
+    const uint8_t data[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+
+    for (uint8_t v = 0; v < VARIANT_COUNT; ++v)
+        TEST_ASSERT_EQUAL_HEX16(0x4B37, VARIANTS[v](data, sizeof(data)));
+}
+
+/* Read 10 holding registers from slave 1, the line carries C5 CD */
+void test_modbus_frame(void) {
+    const uint8_t frame[] = {0x01, 0x03, 0x00, 0x00, 0x00, 0x0A};
+
+    for (uint8_t v = 0; v < VARIANT_COUNT; ++v)
+        TEST_ASSERT_EQUAL_HEX16(0xCDC5, VARIANTS[v](frame, sizeof(frame)));
+}
+
+void test_empty_frame(void) {
+    for (uint8_t v = 0; v < VARIANT_COUNT; ++v)
+        TEST_ASSERT_EQUAL_HEX16(0xFFFF, VARIANTS[v](NULL, 0));
+}
+
+/* Random frames of every length up to twice the Modbus buffer */
+void test_variants_agree(void) {
+    uint8_t frame[128];
+    uint32_t seed = 1;
+
+    for (uint16_t round = 0; round < 64; ++round) {
+        for (uint8_t i = 0; i < sizeof(frame); ++i) {
+            seed = seed * 1664525UL + 1013904223UL;
+            frame[i] = seed >> 24;
+        }
+
+        for (uint8_t length = 0; length <= sizeof(frame); ++length) {
+            uint16_t reference = crc16Bitwise(frame, length);
+
+            TEST_ASSERT_EQUAL_HEX16(reference, crc16Nibble(frame, length));
+            TEST_ASSERT_EQUAL_HEX16(reference, crc16Table(frame, length));
+            TEST_ASSERT_EQUAL_HEX16(reference, crc16(frame, length));
+        }
+    }
+}
+
+/* A frame with its CRC appended, low byte first, has the CRC of zero */
+void test_frame_with_crc_checks_to_zero(void) {
+    uint8_t frame[8] = {0x11, 0x06, 0x00, 0x01, 0x00, 0x03};
+
+    uint16_t crc = crc16(frame, 6);
+    frame[6] = crc & 0xFF;
+    frame[7] = crc >> 8;
+
+    for (uint8_t v = 0; v < VARIANT_COUNT; ++v)
+        TEST_ASSERT_EQUAL_HEX16(0x0000, VARIANTS[v](frame, sizeof(frame)));
+}
+
+/* Every single bit flip of a frame changes the CRC */
+void test_single_bit_errors_are_detected(void) {
+    uint8_t frame[] = {0x01, 0x10, 0x03, 0xE8, 0x00, 0x04, 0x08, 0x00, 0x01, 0x00, 0x01, 0x42, 0x48, 0x00, 0x00};
+    uint16_t reference = crc16(frame, sizeof(frame));
+
+    for (uint8_t i = 0; i < sizeof(frame); ++i) {
+        for (uint8_t bit = 0; bit < 8; ++bit) {
+            frame[i] ^= 1 << bit;
+            TEST_ASSERT_TRUE(crc16(frame, sizeof(frame)) != reference);
+            frame[i] ^= 1 << bit;
+        }
+    }
+}
+
+/* Time stamp counter where there is one, 0 elsewhere */
+static uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Host cost of every variant on a 64 byte frame, the Modbus buffer size.
+ * Cycles are time stamp counter ticks, they follow the nominal clock and
+ * not the turbo one. AVR cycles are printed by the crc_benchmark sketch.
+ */
+void test_benchmark(void) {
+    const uint16_t FRAME_SIZE = 64;
+    const uint32_t ROUNDS = 100000;
+
+    uint8_t frame[FRAME_SIZE];
+    for (uint16_t i = 0; i < FRAME_SIZE; ++i)
+        frame[i] = i * 37 + 11;
+
+    typedef std::chrono::steady_clock clock;
+    volatile uint16_t sink = 0;
+
+    for (uint8_t v = 0; v < VARIANT_COUNT; ++v) {
+        clock::time_point start = clock::now();
+        uint64_t start_cycles = read_cycles();
+
+        for (uint32_t round = 0; round < ROUNDS; ++round) {
+            /* A different frame every round, the call can't be hoisted out */
+            frame[0] = round;
+            sink = VARIANTS[v](frame, FRAME_SIZE);
+        }
+
+        uint64_t cycles = read_cycles() - start_cycles;
+        double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+        double bytes = (double)ROUNDS * FRAME_SIZE;
+
+        char message[96];
+        snprintf(message, sizeof(message), "%s: %.2f ns per byte, %.2f cycles per byte",
+                 VARIANT_NAMES[v], ns / bytes, cycles / bytes);
+        TEST_MESSAGE(message);
+    }
+
+    (void)sink;
+
+    /* The timed calls still compute the right CRC */
+    frame[0] = 0;
+    for (uint8_t v = 0; v < VARIANT_COUNT; ++v)
+        TEST_ASSERT_EQUAL_HEX16(crc16Bitwise(frame, FRAME_SIZE), VARIANTS[v](frame, FRAME_SIZE));
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_check_value);
+    RUN_TEST(test_modbus_frame);
+    RUN_TEST(test_empty_frame);
+    RUN_TEST(test_variants_agree);
+    RUN_TEST(test_frame_with_crc_checks_to_zero);
+    RUN_TEST(test_single_bit_errors_are_detected);
+    RUN_TEST(test_benchmark);
+    return UNITY_END();
+}
@@ -0,0 +1,172 @@
+/**
+ * PidController: anti-windup, step response on a simple plant and the
+ * saturation of the gain products.
+ *
+ * pio test -e native -f native/test_pid_controller
+ */
+#include <unity.h>
+
+#include "BaseParams/Pressure.h"
+#include "pid_controller.h"
+
+/* The same instance as in main.cpp: CONTROL_PERIOD_TICKS * portTICK_PERIOD_MS */
+const uint16_t PERIOD_MS = 30;
+
+const pressure_t MIN_SPEED = 1 * PRESSURE_ONE;
+const pressure_t MAX_SPEED = 100 * PRESSURE_ONE;
+
+typedef PidController<int32_t, int32_t, 12> Pid;
+
+/**
+ * Pump and kidney as a first order lag: the pressure settles at
+ * speed * PLANT_GAIN with the time constant PLANT_TIME_CONSTANT_S.
+ */
+const float PLANT_GAIN = 0.5;
+const float PLANT_TIME_CONSTANT_S = 2.0;
+
+class Plant {
+public:
+    explicit Plant(const float& pressure) : pressure(pressure) {}
+
+    pressure_t step(const pressure_t& speed) {
+        float target = pressure_to_float(speed) * PLANT_GAIN;
+        pressure += (target - pressure) * (PERIOD_MS / 1000.0f) / PLANT_TIME_CONSTANT_S;
+        return pressure_from_float(pressure);
+    }
+
+private:
+    float pressure;
+};
+
+static Pid make_pid(const float& kp, const float& ki, const float& kd) {
+    Pid pid(kp, ki, kd, PERIOD_MS);
+    pid.set_limits(MIN_SPEED, MAX_SPEED);
+    return pid;
+}
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+/**
+ * The pressure can't reach the setpoint (the line is clamped), the output
+ * sits at the limit for a minute. Once the pressure overshoots the
+ * setpoint the output must leave the limit at once instead of unwinding
+ * a minute worth of integral.
+ */
+void test_anti_windup_releases_at_once(void) {
+    Pid pid = make_pid(0.2, 0.2, 0.2);
+    pressure_t setpoint = pressure_from_int(30);
+    pid.reset(setpoint, pressure_from_int(5), MAX_SPEED);
+
+    for (uint16_t i = 0; i < 60000 / PERIOD_MS; ++i)
+        TEST_ASSERT_EQUAL_INT32(MAX_SPEED, pid.compute(setpoint, pressure_from_int(5)));
+
+    /* The line is released and the pressure is 5 units above the setpoint */
+    pressure_t measurement = pressure_from_int(35);
+    pid.compute(setpoint, measurement);
+
+    for (uint8_t i = 0; i < 5; ++i)
+        TEST_ASSERT_LESS_THAN(MAX_SPEED, pid.compute(setpoint, measurement));
+}
+
+void test_anti_windup_low_limit(void) {
+    Pid pid = make_pid(0.2, 0.2, 0);
+    pressure_t setpoint = pressure_from_int(30);
+    pid.reset(setpoint, pressure_from_int(80), MIN_SPEED);
+
+    for (uint16_t i = 0; i < 60000 / PERIOD_MS; ++i)
+        TEST_ASSERT_EQUAL_INT32(MIN_SPEED, pid.compute(setpoint, pressure_from_int(80)));
+
+    TEST_ASSERT_GREATER_THAN(MIN_SPEED, pid.compute(setpoint, pressure_from_int(25)));
+}
+
+/* Closed loop on the plant settles at the setpoint without ringing */
+void test_step_response(void) {
+    Pid pid = make_pid(2, 1, 0.2);
+    Plant plant(10);
+    pressure_t setpoint = pressure_from_int(30);
+    pressure_t measurement = pressure_from_int(10);
+    pid.reset(setpoint, measurement, pressure_from_int(20));
+
+    pressure_t peak = measurement;
+    uint8_t crossings = 0;
+    bool is_above = false;
+
+    for (uint16_t i = 0; i < 120000 / PERIOD_MS; ++i) {
+        measurement = plant.step(pid.compute(setpoint, measurement));
+
+        if (measurement > peak)
+            peak = measurement;
+
+        if ((measurement > setpoint) != is_above) {
+            is_above = !is_above;
+            ++crossings;
+        }
+    }
+
+    /* Within a tenth of a unit after two minutes */
+    TEST_ASSERT_INT32_WITHIN(PRESSURE_ONE / 10, setpoint, measurement);
+
+    /* Overshoot under 10 % of the step, settles in a couple of swings */
+    TEST_ASSERT_LESS_OR_EQUAL_INT32(setpoint + pressure_from_int(2), peak);
+    TEST_ASSERT_LESS_OR_EQUAL(4, crossings);
+}
+
+/* The steady state output doesn't depend on the integral gain rounding */
+void test_step_response_firmware_gains(void) {
+    Pid pid = make_pid(0.2, 0.2, 0.2);
+    Plant plant(20);
+    pressure_t setpoint = pressure_from_int(30);
+    pressure_t measurement = pressure_from_int(20);
+    pid.reset(setpoint, measurement, pressure_from_int(40));
+
+    for (uint16_t i = 0; i < 300000 / PERIOD_MS; ++i)
+        measurement = plant.step(pid.compute(setpoint, measurement));
+
+    TEST_ASSERT_INT32_WITHIN(PRESSURE_ONE / 10, setpoint, measurement);
+    TEST_ASSERT_INT32_WITHIN(PRESSURE_ONE / 5, pressure_from_int(60), pid.get_output());
+}
+
+/**
+ * kd is about 27000 at 12 bits and 30 ms, a jump of 300 units
+ * (76800 at 8 fractional bits) used to overflow kd * derivative and flip
+ * the sign of the output. A rising pressure must drive the output down.
+ */
+void test_derivative_jump_does_not_overflow(void) {
+    Pid pid = make_pid(0.2, 0.2, 0.2);
+    pressure_t setpoint = pressure_from_int(30);
+    pid.reset(setpoint, setpoint, pressure_from_int(50));
+
+    /* The filter passes a quarter of the jump, 128000 after it */
+    TEST_ASSERT_EQUAL_INT32(MIN_SPEED, pid.compute(setpoint, setpoint + pressure_from_int(2000)));
+
+    pid.reset(setpoint, setpoint, pressure_from_int(50));
+    TEST_ASSERT_EQUAL_INT32(MAX_SPEED, pid.compute(setpoint, setpoint - pressure_from_int(2000)));
+}
+
+void test_proportional_does_not_overflow(void) {
+    Pid pid = make_pid(1000, 0, 0);
+
+    TEST_ASSERT_EQUAL_INT32(MAX_SPEED, pid.compute(pressure_from_int(5000), 0));
+    TEST_ASSERT_EQUAL_INT32(MIN_SPEED, pid.compute(0, pressure_from_int(5000)));
+}
+
+/* With no gains at all the output sits at the lower limit whatever the input */
+void test_zero_gains(void) {
+    Pid pid = make_pid(0, 0, 0);
+
+    TEST_ASSERT_EQUAL_INT32(MIN_SPEED, pid.compute(INT32_MAX / 2, INT32_MIN / 2));
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_anti_windup_releases_at_once);
+    RUN_TEST(test_anti_windup_low_limit);
+    RUN_TEST(test_step_response);
+    RUN_TEST(test_step_response_firmware_gains);
+    RUN_TEST(test_derivative_jump_does_not_overflow);
+    RUN_TEST(test_proportional_does_not_overflow);
+    RUN_TEST(test_zero_gains);
+    return UNITY_END();
+}
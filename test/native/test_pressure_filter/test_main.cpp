@@ -0,0 +1,389 @@
+/**
+ * The fixed point pressure pipeline against floating point references
+ * on synthetic ADC traces.
+ *
+ * pio test -e native -f native/test_pressure_filter
+ */
+#include <unity.h>
+
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+
+#include "BaseParams/Pressure.h"
+#include "trimmed_mean_filter.h"
+#include "exponential_smoother.h"
+
+/* ADS1115 in the continuous mode, as in main.cpp */
+const uint32_t SAMPLE_PERIOD_US = 4000;
+
+/* PRESSURE_SMOOTHING_K at 250 SPS and 4.7 s */
+const uint16_t SMOOTHING_K = 55;
+
+const uint8_t FILTER_WINDOW = 10;
+const uint8_t FILTER_TRIM_PERCENT = 20;
+
+/* One pass of the old task_pressure_sensor_read: vTaskDelay(100 / 16) ticks of 15 ms */
+const uint32_t OLD_PASS_PERIOD_US = 90000;
+
+/**
+ * Worst case difference between the fixed point pipeline and the same
+ * pipeline in double, in pressure units:
+ *  - the trimmed mean truncates by less than 1 / 256;
+ *  - the smoother state stops moving when the difference is below
+ *    65536 / 55 state units, that is 1192 / 65536 = 0.018;
+ *  - the shift rounds towards minus infinity, so both errors may add up.
+ */
+const double FIXED_POINT_ERROR_BOUND = 0.025;
+
+const double TARE = 1.5;
+
+/* Deterministic noise, the traces must not change between runs */
+class Lcg {
+public:
+    explicit Lcg(uint32_t seed) : state(seed) {}
+
+    /* Uniform in [-amplitude, amplitude] */
+    int32_t next(const int32_t& amplitude) {
+        state = state * 1664525UL + 1013904223UL;
+        return (int32_t)((state >> 8) % (2 * amplitude + 1)) - amplitude;
+    }
+
+private:
+    uint32_t state;
+};
+
+/* Raw ADC counts for a pressure in units, 0.3125 units per count */
+static int16_t raw_from_pressure(const double& value) {
+    return (int16_t)lround(value / 0.3125);
+}
+
+/**
+ * Trace with sensor noise of a few counts and rare peristaltic spikes,
+ * the shape is given by level(t) in seconds.
+ */
+template <typename Level>
+static std::vector<int16_t> make_trace(const uint32_t& sample_count, uint32_t seed, Level level) {
+    std::vector<int16_t> trace(sample_count);
+    Lcg noise(seed);
+
+    for (uint32_t i = 0; i < sample_count; ++i) {
+        double t = i * (SAMPLE_PERIOD_US / 1e6);
+        int32_t raw = raw_from_pressure(level(t) + TARE) + noise.next(3);
+
+        /* About one sample in a hundred is a spike */
+        if (noise.next(50) == 0)
+            raw += noise.next(200);
+
+        trace[i] = raw;
+    }
+
+    return trace;
+}
+
+static std::vector<int16_t> make_constant_trace() {
+    return make_trace(60 * 250, 1, [](double) { return 30.0; });
+}
+
+static std::vector<int16_t> make_step_trace() {
+    return make_trace(60 * 250, 2, [](double t) { return t < 10.0 ? 20.0 : 40.0; });
+}
+
+static std::vector<int16_t> make_wave_trace() {
+    return make_trace(120 * 250, 3, [](double t) { return 30.0 + 0.1 * t + 8.0 * sin(t * 0.5); });
+}
+
+/* The firmware pipeline: conversion, sliding trimmed mean, per sample smoothing */
+class FixedPipeline {
+public:
+    FixedPipeline()
+        : filter(FILTER_WINDOW, FILTER_TRIM_PERCENT)
+        , smoother(SMOOTHING_K)
+        , tare(pressure_from_float(TARE)) {}
+
+    void reset(const double& value) {
+        smoother.reset(pressure_from_float(value));
+    }
+
+    double push(const int16_t& raw) {
+        pressure_t converted_value = pressure_from_raw(raw) - tare;
+        return pressure_to_float(smoother.push(filter.push(converted_value)));
+    }
+
+private:
+    TrimmedMeanFilter<pressure_t, int32_t, 32> filter;
+    ExponentialSmoother<pressure_t> smoother;
+    pressure_t tare;
+};
+
+/* The same pipeline in double */
+class DoublePipeline {
+public:
+    void reset(const double& value) {
+        smoothed = value;
+    }
+
+    double push(const int16_t& raw) {
+        window.push_back(raw * 7.8125 / 25 - TARE);
+        if (window.size() > FILTER_WINDOW)
+            window.erase(window.begin());
+
+        std::vector<double> sorted(window);
+        std::sort(sorted.begin(), sorted.end());
+
+        size_t trim = sorted.size() * FILTER_TRIM_PERCENT / 100;
+        double sum = 0;
+        for (size_t i = trim; i < sorted.size() - trim; ++i)
+            sum += sorted[i];
+
+        smoothed += (sum / (sorted.size() - 2 * trim) - smoothed) * (SMOOTHING_K / 65536.0);
+        return smoothed;
+    }
+
+private:
+    std::vector<double> window;
+    double smoothed = 0;
+};
+
+/**
+ * The firmware pipeline built on float, as it would be without the fixed
+ * point rework: the same sliding trimmed mean and a float smoother.
+ */
+class FloatPipeline {
+public:
+    FloatPipeline()
+        : filter(FILTER_WINDOW, FILTER_TRIM_PERCENT) {}
+
+    void reset(const float& value) {
+        smoothed = value;
+    }
+
+    float push(const int16_t& raw) {
+        float converted_value = raw * 0.3125f - (float)TARE;
+        smoothed += (filter.push(converted_value) - smoothed) * (SMOOTHING_K / 65536.0f);
+        return smoothed;
+    }
+
+private:
+    TrimmedMeanFilter<float, float, 32> filter;
+    float smoothed = 0;
+};
+
+/**
+ * The filter before the fixed point rework: one read per pass, every
+ * 11th pass sorts the last 10 reads, averages sorted[4..8] and moves the
+ * output by 0.2 of the difference.
+ */
+class OldPipeline {
+public:
+    void reset(const float& value) {
+        pressure = value;
+    }
+
+    /* Called on every pass with the last conversion, returns the output */
+    float pass(const int16_t& raw) {
+        if (counter < 10) {
+            reads[counter++] = raw * 7.8125 / 25 - TARE;
+            return pressure;
+        }
+
+        float sorted[10];
+        std::copy(reads, reads + 10, sorted);
+        std::sort(sorted, sorted + 10);
+
+        float sum = 0;
+        for (uint8_t i = 0; i < 5; ++i)
+            sum += sorted[4 + i];
+
+        pressure += (sum / 5 - pressure) * 0.2f;
+        counter = 0;
+
+        return pressure;
+    }
+
+private:
+    float reads[10];
+    uint8_t counter = 0;
+    float pressure = 0;
+};
+
+/* Old filter output at every new sample, the old task polled the ADC every 90 ms */
+static std::vector<double> run_old(const std::vector<int16_t>& trace, const double& initial) {
+    std::vector<double> output(trace.size());
+    OldPipeline old;
+    old.reset(initial);
+
+    uint32_t next_pass_us = 0;
+    double value = initial;
+
+    for (uint32_t i = 0; i < trace.size(); ++i) {
+        uint32_t now_us = i * SAMPLE_PERIOD_US;
+
+        while (next_pass_us <= now_us) {
+            value = old.pass(trace[i]);
+            next_pass_us += OLD_PASS_PERIOD_US;
+        }
+
+        output[i] = value;
+    }
+
+    return output;
+}
+
+static std::vector<double> run_fixed(const std::vector<int16_t>& trace, const double& initial) {
+    std::vector<double> output(trace.size());
+    FixedPipeline fixed;
+    fixed.reset(initial);
+
+    for (uint32_t i = 0; i < trace.size(); ++i)
+        output[i] = fixed.push(trace[i]);
+
+    return output;
+}
+
+/* Time from the step until the output has covered 63 % of it */
+static double rise_time_s(const std::vector<double>& output, const uint32_t& step_index,
+                          const double& from, const double& to) {
+    double threshold = from + (to - from) * (1 - exp(-1.0));
+
+    for (uint32_t i = step_index; i < output.size(); ++i) {
+        if (output[i] >= threshold)
+            return (i - step_index) * (SAMPLE_PERIOD_US / 1e6);
+    }
+
+    return INFINITY;
+}
+
+static double max_fixed_point_error(const std::vector<int16_t>& trace, const double& initial) {
+    FixedPipeline fixed;
+    DoublePipeline reference;
+    fixed.reset(initial);
+    reference.reset(initial);
+
+    double max_error = 0;
+    for (uint32_t i = 0; i < trace.size(); ++i) {
+        double error = fabs(fixed.push(trace[i]) - reference.push(trace[i]));
+        max_error = std::max(max_error, error);
+    }
+
+    return max_error;
+}
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+void test_fixed_point_matches_double_on_constant(void) {
+    TEST_ASSERT_DOUBLE_WITHIN(FIXED_POINT_ERROR_BOUND, 0, max_fixed_point_error(make_constant_trace(), 30));
+}
+
+void test_fixed_point_matches_double_on_step(void) {
+    TEST_ASSERT_DOUBLE_WITHIN(FIXED_POINT_ERROR_BOUND, 0, max_fixed_point_error(make_step_trace(), 20));
+}
+
+void test_fixed_point_matches_double_on_wave(void) {
+    TEST_ASSERT_DOUBLE_WITHIN(FIXED_POINT_ERROR_BOUND, 0, max_fixed_point_error(make_wave_trace(), 30));
+}
+
+/**
+ * On a steady pressure the old and new filters settle to about the same
+ * value. The old one averaged sorted[4..8] of 10, one value more from the
+ * top than from the bottom, so it sat higher, about 0.4 on this trace.
+ * The new one must stay closer to the true pressure than the old one.
+ */
+void test_new_filter_settles_where_old_did(void) {
+    std::vector<int16_t> trace = make_constant_trace();
+    std::vector<double> old_output = run_old(trace, 30);
+    std::vector<double> new_output = run_fixed(trace, 30);
+
+    double old_sum = 0;
+    double new_sum = 0;
+    double old_deviation = 0;
+    double new_deviation = 0;
+    uint32_t count = 0;
+
+    for (uint32_t i = 30 * 250; i < trace.size(); ++i) {
+        old_sum += old_output[i];
+        new_sum += new_output[i];
+        old_deviation = std::max(old_deviation, fabs(old_output[i] - 30));
+        new_deviation = std::max(new_deviation, fabs(new_output[i] - 30));
+        ++count;
+    }
+
+    TEST_ASSERT_DOUBLE_WITHIN(0.5, old_sum / count, new_sum / count);
+    TEST_ASSERT_LESS_OR_EQUAL(0.2, new_deviation);
+    TEST_ASSERT_LESS_OR_EQUAL(old_deviation, new_deviation);
+}
+
+/* The time constant was kept at about 4.7 s, a step takes as long as before */
+void test_new_filter_step_response_matches_old(void) {
+    std::vector<int16_t> trace = make_step_trace();
+    std::vector<double> old_output = run_old(trace, 20);
+    std::vector<double> new_output = run_fixed(trace, 20);
+
+    double old_rise = rise_time_s(old_output, 10 * 250, 20, 40);
+    double new_rise = rise_time_s(new_output, 10 * 250, 20, 40);
+
+    char message[64];
+    snprintf(message, sizeof(message), "63%% rise: old %.2f s, new %.2f s", old_rise, new_rise);
+    TEST_MESSAGE(message);
+
+    TEST_ASSERT_DOUBLE_WITHIN(0.15 * old_rise, old_rise, new_rise);
+}
+
+/* Nanoseconds per sample of push() over the trace */
+template <typename Pipeline>
+static double time_per_sample_ns(Pipeline& pipeline, const std::vector<int16_t>& trace, double& last) {
+    const uint8_t ROUNDS = 20;
+
+    typedef std::chrono::steady_clock clock;
+    volatile double sink = 0;
+
+    clock::time_point start = clock::now();
+    for (uint8_t round = 0; round < ROUNDS; ++round)
+        for (uint32_t i = 0; i < trace.size(); ++i)
+            sink = pipeline.push(trace[i]);
+    double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+
+    last = sink;
+    return ns / ((uint32_t)ROUNDS * trace.size());
+}
+
+/**
+ * Host timing of one sample through the fixed point pipeline and the same
+ * pipeline on float. A host FPU makes float cheap, so this only shows the
+ * cost on the host; the AVR cycles are measured on the board by
+ * embedded/test_pressure_benchmark. Both timed pipelines must still agree.
+ */
+void test_benchmark(void) {
+    std::vector<int16_t> trace = make_wave_trace();
+
+    FixedPipeline fixed;
+    FloatPipeline floating;
+    fixed.reset(30);
+    floating.reset(30);
+
+    double fixed_last;
+    double float_last;
+    double fixed_ns = time_per_sample_ns(fixed, trace, fixed_last);
+    double float_ns = time_per_sample_ns(floating, trace, float_last);
+
+    char message[96];
+    snprintf(message, sizeof(message), "host, per sample: fixed point %.1f ns, float %.1f ns", fixed_ns, float_ns);
+    TEST_MESSAGE(message);
+
+    TEST_ASSERT_DOUBLE_WITHIN(FIXED_POINT_ERROR_BOUND, float_last, fixed_last);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_fixed_point_matches_double_on_constant);
+    RUN_TEST(test_fixed_point_matches_double_on_step);
+    RUN_TEST(test_fixed_point_matches_double_on_wave);
+    RUN_TEST(test_new_filter_settles_where_old_did);
+    RUN_TEST(test_new_filter_step_response_matches_old);
+    RUN_TEST(test_benchmark);
+    return UNITY_END();
+}
@@ -0,0 +1,540 @@
+/**
+ * Compact stream frames: encoded by TelemetryDeltaEncoder and framed by
+ * TelemetryFramer, then decoded back the way the host does it.
+ *
+ * The traces are synthetic, a pressure wave with noise and slow fields,
+ * no recording of the stand is available. The ratios measured here hold
+ * for this trace only, a real one may compress better or worse.
+ *
+ * pio test -e native -f native/test_telemetry_delta
+ */
+#include <unity.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "telemetry.h"
+#include "telemetry.cpp"
+#include "ModbusCrc.cpp"
+
+/* One slot as the host sees it */
+struct Point {
+    uint16_t slot;
+    uint8_t mask;
+    int32_t values[TELEMETRY_FIELD_COUNT];
+};
+
+static uint32_t zigzag_decode(const uint32_t& value) {
+    return (value >> 1) ^ (0 - (value & 1));
+}
+
+/* Returns the decoded size, 0 if the varint runs past the end */
+static uint8_t varint_decode(const uint8_t* data, const uint8_t& size, uint32_t& value) {
+    value = 0;
+
+    for (uint8_t i = 0; i < size && i < TELEMETRY_VARINT_MAX_SIZE; ++i) {
+        value |= (uint32_t)(data[i] & 0x7F) << (7 * i);
+
+        if (!(data[i] & 0x80))
+            return i + 1;
+    }
+
+    return 0;
+}
+
+/* Returns the decoded size, 0 on a broken frame; frame is without the delimiter */
+static uint8_t cobs_decode(const uint8_t* frame, const uint8_t& size, uint8_t* data) {
+    uint8_t out_size = 0;
+    uint8_t i = 0;
+
+    while (i < size) {
+        uint8_t code = frame[i++];
+
+        if (code == 0 || i + code - 1 > size)
+            return 0;
+
+        for (uint8_t j = 1; j < code; ++j)
+            data[out_size++] = frame[i++];
+
+        if (code != 0xFF && i < size)
+            data[out_size++] = 0;
+    }
+
+    return out_size;
+}
+
+/**
+ * The host side: keeps the last keyframe and drops the deltas that refer
+ * to another one.
+ */
+class StreamDecoder {
+public:
+    std::vector<Point> points;
+    uint32_t key_count = 0;
+    uint32_t delta_count = 0;
+    uint32_t dropped_count = 0;
+    uint32_t bytes = 0;
+
+    /* One frame with its delimiter, false if it doesn't decode */
+    bool feed(const uint8_t* frame, const uint8_t& size) {
+        bytes += size;
+
+        uint8_t raw[TELEMETRY_MAX_FRAME_SIZE];
+        uint8_t raw_size = cobs_decode(frame, size - 1, raw);
+
+        if (raw_size < TELEMETRY_HEADER_SIZE + 2 || crc16(raw, raw_size) != 0)
+            return false;
+
+        if (raw[0] != TELEMETRY_PROTOCOL_VERSION)
+            return false;
+
+        uint8_t sequence = raw[2];
+        const uint8_t* payload = &raw[TELEMETRY_HEADER_SIZE];
+        uint8_t payload_size = raw_size - TELEMETRY_HEADER_SIZE - 2;
+
+        if (raw[1] == TELEMETRY_FRAME_STREAM_KEY)
+            return feed_key(sequence, payload, payload_size);
+
+        if (raw[1] == TELEMETRY_FRAME_STREAM_DELTA)
+            return feed_delta(payload, payload_size);
+
+        return false;
+    }
+
+private:
+    bool feed_key(const uint8_t& sequence, const uint8_t* payload, const uint8_t& size) {
+        Point point = {};
+        uint8_t i = 0;
+
+        memcpy(&point.slot, &payload[i], 2);
+        i += 2;
+        point.mask = payload[i++];
+
+        for (uint8_t field = 0; field < TELEMETRY_FIELD_COUNT; ++field) {
+            if (!(point.mask & (1 << field)))
+                continue;
+
+            memcpy(&point.values[field], &payload[i], telemetry_field_size(field));
+            i += telemetry_field_size(field);
+        }
+
+        if (i != size)
+            return false;
+
+        key = point;
+        key_sequence = sequence;
+        has_key = true;
+        ++key_count;
+
+        points.push_back(point);
+        return true;
+    }
+
+    bool feed_delta(const uint8_t* payload, const uint8_t& size) {
+        ++delta_count;
+
+        if (!has_key || payload[0] != key_sequence) {
+            ++dropped_count;
+            return true;
+        }
+
+        /* The first slot refers to the keyframe, the next ones to the slots before them */
+        Point reference = key;
+        uint8_t i = 1;
+
+        while (i < size) {
+            Point point = {};
+            uint8_t mask = payload[i++];
+            uint32_t offset = 1;
+
+            if (!(mask & TELEMETRY_DELTA_NEXT_SLOT)) {
+                uint8_t n = varint_decode(&payload[i], size - i, offset);
+
+                if (n == 0)
+                    return false;
+
+                i += n;
+            }
+
+            point.slot = reference.slot + offset;
+            point.mask = mask & ~TELEMETRY_DELTA_NEXT_SLOT;
+
+            for (uint8_t field = 0; field < TELEMETRY_FIELD_COUNT; ++field) {
+                if (!(point.mask & (1 << field)))
+                    continue;
+
+                if (field == TELEMETRY_FIELD_STATE) {
+                    memcpy(&point.values[field], &payload[i], 3);
+                    i += 3;
+                    continue;
+                }
+
+                uint32_t delta;
+                uint8_t n = varint_decode(&payload[i], size - i, delta);
+
+                if (n == 0)
+                    return false;
+
+                i += n;
+                point.values[field] = (int32_t)((uint32_t)reference.values[field] + zigzag_decode(delta));
+                reference.values[field] = point.values[field];
+            }
+
+            reference.slot = point.slot;
+            points.push_back(point);
+        }
+
+        return i == size;
+    }
+
+    Point key = {};
+    uint8_t key_sequence = 0;
+    bool has_key = false;
+};
+
+/* The firmware side: the encoder and the framer as the telemetry task drives them */
+class StreamEncoder {
+public:
+    explicit StreamEncoder(const uint8_t& key_interval) {
+        encoder.set_key_interval(key_interval);
+    }
+
+    /* Frames go to the decoder unless drop returns true for their sequence */
+    template <typename Drop>
+    void add(const Point& point, const uint8_t& streamed_mask, StreamDecoder& decoder, Drop drop) {
+        while (!encoder.add(point.slot, point.mask, streamed_mask, point.values, framer.get_sequence()))
+            flush(decoder, drop);
+    }
+
+    void add(const Point& point, const uint8_t& streamed_mask, StreamDecoder& decoder) {
+        add(point, streamed_mask, decoder, [](uint8_t) { return false; });
+    }
+
+    template <typename Drop>
+    void flush(StreamDecoder& decoder, Drop drop) {
+        if (encoder.is_empty())
+            return;
+
+        TelemetryFrameType type;
+        uint8_t size;
+        const uint8_t* payload = encoder.finish(type, size);
+
+        uint8_t sequence = framer.get_sequence();
+        uint8_t frame[TELEMETRY_MAX_FRAME_SIZE];
+        uint8_t frame_size = framer.build(type, payload, size, frame);
+        TEST_ASSERT_NOT_EQUAL(0, frame_size);
+
+        ++frame_count;
+        if (type == TELEMETRY_FRAME_STREAM_KEY)
+            ++key_count;
+
+        if (!drop(sequence))
+            TEST_ASSERT_TRUE(decoder.feed(frame, frame_size));
+    }
+
+    void flush(StreamDecoder& decoder) {
+        flush(decoder, [](uint8_t) { return false; });
+    }
+
+    uint32_t frame_count = 0;
+    uint32_t key_count = 0;
+
+private:
+    TelemetryDeltaEncoder encoder;
+    TelemetryFramer framer;
+};
+
+/* Ratios of the synthetic trace: pressures every slot, flow at 20 Hz, the slow fields at 1-2 Hz */
+const uint8_t TRACE_RATIOS[TELEMETRY_FIELD_COUNT] = {1, 1, 5, 100, 100, 50, 100};
+
+/* The control task hands over the points of one cycle, 30 ms */
+const uint8_t POINTS_PER_CYCLE = 3;
+
+static uint8_t trace_mask(const uint16_t& slot) {
+    uint8_t mask = 0;
+
+    for (uint8_t i = 0; i < TELEMETRY_FIELD_COUNT; ++i) {
+        if (slot % TRACE_RATIOS[i] == 0)
+            mask |= 1 << i;
+    }
+
+    return mask;
+}
+
+/* A perfusion pressure wave with noise, quantized as the firmware does it */
+static std::vector<Point> make_trace(const uint32_t& slot_count, const uint16_t& first_slot) {
+    std::vector<Point> trace;
+    uint32_t seed = 1;
+
+    for (uint32_t s = 0; s < slot_count; ++s) {
+        Point point = {};
+        point.slot = first_slot + s;
+        point.mask = trace_mask(point.slot);
+
+        double t = s / (double)TELEMETRY_STREAM_RATE_HZ;
+        seed = seed * 1664525UL + 1013904223UL;
+        float pressure = 60 + 15 * sin(2 * M_PI * 1.2 * t) + (int32_t)(seed >> 25) * 0.01f - 0.64f;
+
+        point.values[TELEMETRY_FIELD_PRESSURE] = telemetry_quantize(TELEMETRY_FIELD_PRESSURE, pressure);
+        point.values[TELEMETRY_FIELD_PRESSURE_MEAN] = telemetry_quantize(TELEMETRY_FIELD_PRESSURE_MEAN, pressure + 0.3f);
+        point.values[TELEMETRY_FIELD_FLOW] = telemetry_quantize(TELEMETRY_FIELD_FLOW, 36.0f + 0.5f * sin(t));
+        point.values[TELEMETRY_FIELD_TEMPERATURE1] = telemetry_quantize(TELEMETRY_FIELD_TEMPERATURE1, 4.0f + t * 0.001f);
+        point.values[TELEMETRY_FIELD_TEMPERATURE2] = telemetry_quantize(TELEMETRY_FIELD_TEMPERATURE2, 5.2f);
+        point.values[TELEMETRY_FIELD_TARGET] = telemetry_quantize(TELEMETRY_FIELD_TARGET, 60.0f);
+        point.values[TELEMETRY_FIELD_STATE] = 1 | 0x0F << 16;
+
+        trace.push_back(point);
+    }
+
+    return trace;
+}
+
+static uint8_t streamed_mask() {
+    uint8_t mask = 0;
+
+    for (uint8_t i = 0; i < TELEMETRY_FIELD_COUNT; ++i)
+        mask |= 1 << i;
+
+    return mask;
+}
+
+/* Bytes of the same points as TELEMETRY_FRAME_STREAM frames, one per slot */
+static uint32_t plain_stream_bytes(const std::vector<Point>& trace) {
+    uint32_t bytes = 0;
+
+    for (const Point& point : trace) {
+        bytes += TELEMETRY_FRAME_OVERHEAD + TELEMETRY_STREAM_HEADER_SIZE;
+
+        for (uint8_t i = 0; i < TELEMETRY_FIELD_COUNT; ++i) {
+            if (point.mask & (1 << i))
+                bytes += telemetry_field_size(i);
+        }
+    }
+
+    return bytes;
+}
+
+static void assert_point_equal(const Point& expected, const Point& actual) {
+    TEST_ASSERT_EQUAL_UINT16(expected.slot, actual.slot);
+
+    /* A keyframe carries every streamed field, the due ones must be there */
+    TEST_ASSERT_EQUAL_HEX8(expected.mask, actual.mask & expected.mask);
+
+    for (uint8_t i = 0; i < TELEMETRY_FIELD_COUNT; ++i) {
+        if (expected.mask & (1 << i))
+            TEST_ASSERT_EQUAL_INT32(expected.values[i], actual.values[i]);
+    }
+}
+
+static StreamDecoder run_trace(const std::vector<Point>& trace, StreamEncoder& encoder) {
+    StreamDecoder decoder;
+
+    for (uint32_t i = 0; i < trace.size(); ++i) {
+        encoder.add(trace[i], streamed_mask(), decoder);
+
+        if (i % POINTS_PER_CYCLE == POINTS_PER_CYCLE - 1)
+            encoder.flush(decoder);
+    }
+
+    encoder.flush(decoder);
+    return decoder;
+}
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+void test_zigzag_extremes(void) {
+    const int32_t values[] = {0, -1, 1, -2, 2, 63, -64, 64, INT32_MAX, INT32_MIN, INT32_MIN + 1};
+    const uint32_t expected[] = {0, 1, 2, 3, 4, 126, 127, 128, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFD};
+
+    for (uint8_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+        TEST_ASSERT_EQUAL_HEX32(expected[i], zigzag_encode(values[i]));
+        TEST_ASSERT_EQUAL_INT32(values[i], (int32_t)zigzag_decode(zigzag_encode(values[i])));
+    }
+}
+
+void test_varint_sizes(void) {
+    const uint32_t values[] = {0, 0x7F, 0x80, 0x3FFF, 0x4000, 0x1FFFFF, 0x200000, 0xFFFFFFF, 0x10000000, 0xFFFFFFFF};
+    const uint8_t sizes[] = {1, 1, 2, 2, 3, 3, 4, 4, 5, 5};
+
+    for (uint8_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+        uint8_t encoded[TELEMETRY_VARINT_MAX_SIZE];
+        uint32_t decoded;
+
+        TEST_ASSERT_EQUAL_UINT8(sizes[i], varint_encode(values[i], encoded));
+        TEST_ASSERT_EQUAL_UINT8(sizes[i], varint_decode(encoded, sizes[i], decoded));
+        TEST_ASSERT_EQUAL_HEX32(values[i], decoded);
+    }
+}
+
+/* Every point comes back, a keyframe at least every key_interval frames */
+void test_round_trip_with_keyframes(void) {
+    const uint8_t intervals[] = {1, 2, 10, 30, 100, 255};
+    std::vector<Point> trace = make_trace(3000, 0);
+
+    for (uint8_t interval : intervals) {
+        StreamEncoder encoder(interval);
+        StreamDecoder decoder = run_trace(trace, encoder);
+
+        TEST_ASSERT_EQUAL_UINT32(trace.size(), decoder.points.size());
+        for (uint32_t i = 0; i < trace.size(); ++i)
+            assert_point_equal(trace[i], decoder.points[i]);
+
+        TEST_ASSERT_EQUAL_UINT32(0, decoder.dropped_count);
+        TEST_ASSERT_GREATER_OR_EQUAL_UINT32((encoder.frame_count + interval - 1) / interval, encoder.key_count);
+    }
+}
+
+/* A field enabled after the keyframe has nothing to refer to */
+void test_new_field_forces_keyframe(void) {
+    StreamEncoder encoder(100);
+    StreamDecoder decoder;
+
+    Point point = {};
+    point.mask = 1 << TELEMETRY_FIELD_PRESSURE;
+    point.values[TELEMETRY_FIELD_PRESSURE] = 6000;
+    point.values[TELEMETRY_FIELD_FLOW] = 3600;
+
+    encoder.add(point, point.mask, decoder);
+    encoder.flush(decoder);
+
+    point.slot = 1;
+    encoder.add(point, point.mask, decoder);
+    encoder.flush(decoder);
+    TEST_ASSERT_EQUAL_UINT32(1, decoder.key_count);
+
+    point.slot = 2;
+    point.mask |= 1 << TELEMETRY_FIELD_FLOW;
+    encoder.add(point, point.mask, decoder);
+    encoder.flush(decoder);
+
+    TEST_ASSERT_EQUAL_UINT32(2, decoder.key_count);
+    TEST_ASSERT_EQUAL_UINT32(3, decoder.points.size());
+    assert_point_equal(point, decoder.points[2]);
+}
+
+/* A jump too big for a delta goes in a keyframe of its own */
+void test_large_delta_becomes_keyframe(void) {
+    StreamEncoder encoder(100);
+    StreamDecoder decoder;
+
+    Point point = {};
+    point.mask = 0x3F;
+
+    encoder.add(point, point.mask, decoder);
+    encoder.flush(decoder);
+
+    /* 6 fields of 5 bytes, the key sequence, mask and offset don't fit in a payload */
+    point.slot = 2;
+    for (uint8_t i = 0; i < TELEMETRY_FIELD_STATE; ++i)
+        point.values[i] = (i % 2) ? INT32_MIN : INT32_MAX;
+
+    encoder.add(point, point.mask, decoder);
+    encoder.flush(decoder);
+
+    TEST_ASSERT_EQUAL_UINT32(2, decoder.key_count);
+    TEST_ASSERT_EQUAL_UINT32(0, decoder.delta_count);
+    assert_point_equal(point, decoder.points[1]);
+
+    /* The delta to the new keyframe wraps around and still decodes */
+    point.slot = 3;
+    point.values[0] = INT32_MIN;
+    encoder.add(point, point.mask, decoder);
+    encoder.flush(decoder);
+
+    TEST_ASSERT_EQUAL_UINT32(1, decoder.delta_count);
+    assert_point_equal(point, decoder.points[2]);
+}
+
+/**
+ * The slot numbers and the frame sequence both wrap around during the
+ * trace, the deltas after the wrap still find their keyframe.
+ */
+void test_sequence_and_slot_wrap(void) {
+    std::vector<Point> trace = make_trace(3000, 65536 - 1500);
+    StreamEncoder encoder(30);
+    StreamDecoder decoder = run_trace(trace, encoder);
+
+    TEST_ASSERT_GREATER_THAN_UINT32(512, encoder.frame_count);
+    TEST_ASSERT_EQUAL_UINT32(trace.size(), decoder.points.size());
+
+    for (uint32_t i = 0; i < trace.size(); ++i)
+        assert_point_equal(trace[i], decoder.points[i]);
+}
+
+/* A lost keyframe loses its group, a lost delta only itself */
+void test_lost_frames(void) {
+    std::vector<Point> trace = make_trace(600, 0);
+    StreamEncoder encoder(10);
+    StreamDecoder decoder;
+
+    /* Sequence 0 is the first keyframe, 10 a keyframe too, 5 a delta */
+    auto drop = [](uint8_t sequence) { return sequence == 5 || sequence == 10; };
+
+    for (uint32_t i = 0; i < trace.size(); ++i) {
+        encoder.add(trace[i], streamed_mask(), decoder, drop);
+
+        if (i % POINTS_PER_CYCLE == POINTS_PER_CYCLE - 1)
+            encoder.flush(decoder, drop);
+    }
+
+    encoder.flush(decoder, drop);
+
+    /**
+     * A cycle is 3 points. The keyframe takes one of them and the rest of
+     * its cycle goes in the next delta: the lost delta holds 3 points and
+     * the group of 10 frames 1 + 2 + 8 * 3.
+     */
+    TEST_ASSERT_EQUAL_UINT32(9, decoder.dropped_count);
+    TEST_ASSERT_EQUAL_UINT32(trace.size() - 3 - 27, decoder.points.size());
+
+    /* Whatever came back is right */
+    uint32_t t = 0;
+    for (const Point& point : decoder.points) {
+        while (trace[t].slot != point.slot)
+            ++t;
+
+        assert_point_equal(trace[t], point);
+    }
+}
+
+/**
+ * Wire bytes against the plain stream frames on the synthetic trace.
+ * A pressure field takes one byte and a slot one more for its mask, so
+ * most of what is left is the frame itself: header, CRC, COBS, the
+ * delimiter and the key sequence, 8 bytes for the 3 points of a cycle.
+ */
+void test_compression_ratio(void) {
+    std::vector<Point> trace = make_trace(3000, 0);
+    uint32_t plain_bytes = plain_stream_bytes(trace);
+
+    const uint8_t intervals[] = {10, 30, 100};
+
+    for (uint8_t interval : intervals) {
+        StreamEncoder encoder(interval);
+        StreamDecoder decoder = run_trace(trace, encoder);
+
+        char message[96];
+        snprintf(message, sizeof(message), "key interval %u: plain %u B, compact %u B, %.2fx", interval,
+                 (unsigned)plain_bytes, (unsigned)decoder.bytes, (double)plain_bytes / decoder.bytes);
+        TEST_MESSAGE(message);
+
+        TEST_ASSERT_LESS_THAN_UINT32(plain_bytes * 10 / 24, decoder.bytes);
+    }
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_zigzag_extremes);
+    RUN_TEST(test_varint_sizes);
+    RUN_TEST(test_round_trip_with_keyframes);
+    RUN_TEST(test_new_field_forces_keyframe);
+    RUN_TEST(test_large_delta_becomes_keyframe);
+    RUN_TEST(test_sequence_and_slot_wrap);
+    RUN_TEST(test_lost_frames);
+    RUN_TEST(test_compression_ratio);
+    return UNITY_END();
+}